@@ -0,0 +1,331 @@
+#include <b_tree.hpp>
+#include <rb_tree.hpp>
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Microbenchmarks of the tree API without the driver's parsing and I/O.
+// Every container runs add, find hit/miss, saveToBinary, readFromBinary,
+// operator==, clear and remove over each size and key distribution:
+//   uniform - random keys, looked up in random order
+//   sorted  - ascending keys, added and looked up in order
+//   zipf    - random keys, lookups skewed towards a few hot keys (s = 1)
+// std::map and std::set are the baselines. One result per line, as CSV
+// or JSON lines.
+// Usage: bench [--sizes 1000,10000,...] [--distributions uniform,...]
+//              [--format csv|json]
+
+using namespace rb_tree;
+
+struct Entry {
+    uint64_t key;
+    uint64_t value;
+
+    void serialize(std::ostream &os) const {
+        os.write(reinterpret_cast<const char *>(&key), sizeof(key));
+        os.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static Entry deserialize(std::istream &is) {
+        Entry entry;
+        is.read(reinterpret_cast<char *>(&entry.key), sizeof(entry.key));
+        is.read(reinterpret_cast<char *>(&entry.value), sizeof(entry.value));
+        return entry;
+    }
+};
+
+bool operator==(Entry const &a, Entry const &b) { return a.key == b.key; }
+auto operator<=>(Entry const &a, Entry const &b) { return a.key <=> b.key; }
+bool operator==(Entry const &a, uint64_t b) { return a.key == b; }
+auto operator<=>(Entry const &a, uint64_t b) { return a.key <=> b; }
+
+std::ostream &operator<<(std::ostream &os, Entry const &entry) {
+    return os << entry.key << " " << entry.value;
+}
+
+template <typename Func>
+double measureNs(Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+// RBTree and BTree through the same calls
+template <typename Tree>
+class TreeContender {
+  public:
+    void add(uint64_t key) { tree.try_add(Entry{key, key}); }
+    bool find(uint64_t key) const { return tree.try_find(key) != nullptr; }
+    bool remove(uint64_t key) { return tree.try_remove(key); }
+    void save(std::ostream &os) const { tree.saveToBinary(os); }
+    void load(std::istream &is) { tree = Tree::readFromBinary(is); }
+    void clear() { tree.clear(); }
+    bool operator==(TreeContender const &other) const {
+        return tree == other.tree;
+    }
+
+  private:
+    Tree tree;
+};
+
+// Baselines write the same records RBTree does and rebuild from them in
+// order, with a hint
+class MapContender {
+  public:
+    void add(uint64_t key) { map.emplace(key, key); }
+    bool find(uint64_t key) const { return map.find(key) != map.end(); }
+    bool remove(uint64_t key) { return map.erase(key) > 0; }
+    void save(std::ostream &os) const {
+        uint64_t size = map.size();
+        os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        for (auto const &[key, value] : map) {
+            Entry{key, value}.serialize(os);
+        }
+    }
+    void load(std::istream &is) {
+        uint64_t size = 0;
+        is.read(reinterpret_cast<char *>(&size), sizeof(size));
+        map.clear();
+        for (uint64_t i = 0; i < size; ++i) {
+            auto entry = Entry::deserialize(is);
+            map.emplace_hint(map.end(), entry.key, entry.value);
+        }
+    }
+    void clear() { map.clear(); }
+    bool operator==(MapContender const &other) const {
+        return map == other.map;
+    }
+
+  private:
+    std::map<uint64_t, uint64_t> map;
+};
+
+class SetContender {
+  public:
+    void add(uint64_t key) { set.insert(Entry{key, key}); }
+    bool find(uint64_t key) const { return set.find(key) != set.end(); }
+    bool remove(uint64_t key) {
+        auto it = set.find(key);
+        if (it == set.end()) {
+            return false;
+        }
+        set.erase(it);
+        return true;
+    }
+    void save(std::ostream &os) const {
+        uint64_t size = set.size();
+        os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        for (auto const &entry : set) {
+            entry.serialize(os);
+        }
+    }
+    void load(std::istream &is) {
+        uint64_t size = 0;
+        is.read(reinterpret_cast<char *>(&size), sizeof(size));
+        set.clear();
+        for (uint64_t i = 0; i < size; ++i) {
+            set.insert(set.end(), Entry::deserialize(is));
+        }
+    }
+    void clear() { set.clear(); }
+    bool operator==(SetContender const &other) const {
+        return set == other.set;
+    }
+
+  private:
+    std::set<Entry, std::less<>> set;
+};
+
+// Keys to add and keys to look up. Added keys are even, so every odd key
+// is a guaranteed miss.
+struct Workload {
+    std::string distribution;
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> hits;
+    std::vector<uint64_t> misses;
+};
+
+Workload makeWorkload(std::string const &distribution, std::size_t size,
+                      std::mt19937_64 &rng) {
+    Workload workload{distribution, {}, {}, {}};
+    workload.keys.resize(size);
+    workload.hits.resize(size);
+    for (std::size_t i = 0; i < size; ++i) {
+        workload.keys[i] = distribution == "sorted" ? 2 * uint64_t(i)
+                                                    : rng() & ~uint64_t(1);
+    }
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::uniform_int_distribution<std::size_t> pick(0, size - 1);
+    for (std::size_t i = 0; i < size; ++i) {
+        if (distribution == "sorted") {
+            workload.hits[i] = workload.keys[i];
+        } else if (distribution == "zipf") {
+            // Inverse of the continuous 1/x distribution over the ranks;
+            // keys are in random order, so rank r is an arbitrary key
+            auto rank = static_cast<std::size_t>(
+                std::pow(static_cast<double>(size) + 1.0, unit(rng)) - 1.0);
+            workload.hits[i] = workload.keys[std::min(rank, size - 1)];
+        } else {
+            workload.hits[i] = workload.keys[pick(rng)];
+        }
+    }
+    for (auto key : workload.hits) {
+        workload.misses.push_back(key | 1);
+    }
+    return workload;
+}
+
+class Output {
+  public:
+    explicit Output(bool json) : json(json) {
+        if (!json) {
+            std::cout << "container,distribution,size,operation,ns_per_op\n";
+        }
+    }
+
+    void emit(std::string const &container, std::string const &distribution,
+              std::size_t size, std::string const &operation, double ns) {
+        if (json) {
+            std::cout << "{\"container\":\"" << container
+                      << "\",\"distribution\":\"" << distribution
+                      << "\",\"size\":" << size << ",\"operation\":\""
+                      << operation << "\",\"ns_per_op\":" << ns << "}\n";
+        } else {
+            std::cout << container << "," << distribution << "," << size
+                      << "," << operation << "," << ns << "\n";
+        }
+    }
+
+  private:
+    bool json;
+};
+
+// Small sizes are repeated so that every operation runs about a million
+// times in total
+template <typename Contender>
+uint64_t run(std::string const &name, Workload const &workload,
+             Output &output) {
+    auto size = workload.keys.size();
+    auto rounds = std::max<std::size_t>(1, 1'000'000 / size);
+    uint64_t checksum = 0;
+    double add = 0, hit = 0, miss = 0, save = 0, load = 0, equal = 0,
+           clear = 0, remove = 0;
+    for (std::size_t round = 0; round < rounds; ++round) {
+        Contender contender;
+        add += measureNs([&] {
+            for (auto key : workload.keys) {
+                contender.add(key);
+            }
+        });
+        hit += measureNs([&] {
+            for (auto key : workload.hits) {
+                checksum += contender.find(key);
+            }
+        });
+        miss += measureNs([&] {
+            for (auto key : workload.misses) {
+                checksum += contender.find(key);
+            }
+        });
+        std::stringstream stream;
+        save += measureNs([&] { contender.save(stream); });
+        Contender loaded;
+        load += measureNs([&] { loaded.load(stream); });
+        equal += measureNs([&] { checksum += contender == loaded; });
+        clear += measureNs([&] { loaded.clear(); });
+        remove += measureNs([&] {
+            for (auto key : workload.keys) {
+                checksum += contender.remove(key);
+            }
+        });
+    }
+    auto ops = static_cast<double>(rounds * size);
+    auto emit = [&](char const *operation, double ns) {
+        output.emit(name, workload.distribution, size, operation, ns / ops);
+    };
+    emit("add", add);
+    emit("find_hit", hit);
+    emit("find_miss", miss);
+    emit("save", save);
+    emit("load", load);
+    emit("equal", equal);
+    emit("clear", clear);
+    emit("remove", remove);
+    return checksum;
+}
+
+std::vector<std::string> splitList(std::string const &list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    for (std::string item; std::getline(stream, item, ',');) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+int usage() {
+    std::cerr << "Usage: bench [--sizes 1000,10000,...] "
+                 "[--distributions uniform,sorted,zipf] "
+                 "[--format csv|json]\n";
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::size_t> sizes{1'000, 10'000, 100'000, 1'000'000,
+                                   10'000'000};
+    std::vector<std::string> distributions{"uniform", "sorted", "zipf"};
+    bool json = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            return usage();
+        }
+        std::string value = argv[++i];
+        if (arg == "--sizes") {
+            sizes.clear();
+            for (auto const &item : splitList(value)) {
+                sizes.push_back(std::stoul(item));
+            }
+        } else if (arg == "--distributions") {
+            distributions = splitList(value);
+        } else if (arg == "--format" && (value == "csv" || value == "json")) {
+            json = value == "json";
+        } else {
+            return usage();
+        }
+    }
+    for (auto const &distribution : distributions) {
+        if (distribution != "uniform" && distribution != "sorted" &&
+            distribution != "zipf") {
+            return usage();
+        }
+    }
+
+    using Tree = RBTree<Entry, std::equal_to<>, ThreeWayLess<>>;
+    using Btree = BTree<Entry, std::equal_to<>, ThreeWayLess<>>;
+    Output output(json);
+    std::mt19937_64 rng(2024);
+    uint64_t checksum = 0;
+    for (auto const &distribution : distributions) {
+        for (auto size : sizes) {
+            if (size == 0) {
+                continue;
+            }
+            auto workload = makeWorkload(distribution, size, rng);
+            checksum += run<TreeContender<Tree>>("RBTree", workload, output);
+            checksum += run<TreeContender<Btree>>("BTree", workload, output);
+            checksum += run<MapContender>("std::map", workload, output);
+            checksum += run<SetContender>("std::set", workload, output);
+        }
+    }
+    std::cerr << "checksum: " << checksum << "\n";
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <b_tree.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// BTree against RBTree on the same keys: random adds, hit and miss lookups
+// one by one and through find_batch, in-order iteration and removals.
+// Usage: btree_bench [element count]
+
+using namespace rb_tree;
+
+template <typename Func>
+double measureNs(Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+void report(std::string const &name, double ns, size_t ops) {
+    std::cout << name << ": " << ns / static_cast<double>(ops) << " ns/op\n";
+}
+
+template <typename Tree>
+size_t run(std::string const &name, std::vector<uint64_t> const &keys,
+           std::vector<uint64_t> const &misses) {
+    size_t found = 0;
+    Tree tree;
+    report(name + " add", measureNs([&] {
+               for (auto key : keys) {
+                   tree.try_add(key);
+               }
+           }),
+           keys.size());
+    report(name + " find hit", measureNs([&] {
+               for (auto key : keys) {
+                   found += tree.try_find(key) != nullptr;
+               }
+           }),
+           keys.size());
+    report(name + " find miss", measureNs([&] {
+               for (auto key : misses) {
+                   found += tree.try_find(key) != nullptr;
+               }
+           }),
+           misses.size());
+    std::vector<uint64_t const *> out(keys.size());
+    report(name + " find_batch hit", measureNs([&] {
+               tree.find_batch(std::span<uint64_t const>(keys),
+                               std::span<uint64_t const *>(out));
+           }),
+           keys.size());
+    uint64_t sum = 0;
+    report(name + " iterate", measureNs([&] {
+               for (auto key : tree) {
+                   sum += key;
+               }
+           }),
+           keys.size());
+    found += sum & 1;
+    report(name + " remove", measureNs([&] {
+               for (auto key : keys) {
+                   found += tree.try_remove(key);
+               }
+           }),
+           keys.size());
+    return found;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+    std::mt19937_64 rng(2024);
+    // Even keys are stored, odd ones are looked up as misses
+    std::vector<uint64_t> keys(count);
+    std::vector<uint64_t> misses(count);
+    for (size_t i = 0; i < count; ++i) {
+        keys[i] = rng() & ~uint64_t(1);
+        misses[i] = keys[i] | 1;
+    }
+
+    size_t found = run<RBTree<uint64_t>>("RBTree", keys, misses);
+    found += run<BTree<uint64_t>>("BTree", keys, misses);
+    std::cout << "checksum: " << found << "\n";
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include <rb_tree_concurrent.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Lookup throughput of ConcurrentRBTree against an RBTree behind a
+// std::shared_mutex, for a growing number of reader threads while one
+// writer keeps adding and removing keys, along with what the writer gets
+// done meanwhile.
+// Usage: concurrent_bench [element count] [milliseconds per run]
+
+using namespace rb_tree;
+
+// Same interface as ConcurrentRBTree, guarded by a single shared_mutex
+class SharedMutexTree {
+  public:
+    bool contains(uint64_t key) const {
+        std::shared_lock guard(mutex);
+        return tree.try_find(key) != nullptr;
+    }
+
+    bool try_add(uint64_t key) {
+        std::lock_guard guard(mutex);
+        return tree.try_add(key);
+    }
+
+    bool try_remove(uint64_t key) {
+        std::lock_guard guard(mutex);
+        return tree.try_remove(key);
+    }
+
+  private:
+    RBTree<uint64_t> tree;
+    mutable std::shared_mutex mutex;
+};
+
+// Keeps the lookups from being optimized away
+std::atomic<uint64_t> hits{0};
+
+struct Throughput {
+    double lookups;
+    double writes;
+};
+
+template <typename Tree>
+Throughput measure(Tree &tree, size_t count, size_t readers,
+                   std::chrono::milliseconds duration) {
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> lookups{0};
+    uint64_t writes = 0;
+    std::vector<std::thread> threads;
+    for (size_t r = 0; r < readers; ++r) {
+        threads.emplace_back([&, r] {
+            std::mt19937_64 rng(r + 1);
+            uint64_t done = 0;
+            uint64_t found = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 256; ++i) {
+                    found += tree.contains(rng() % (2 * count));
+                }
+                done += 256;
+            }
+            lookups += done;
+            hits += found;
+        });
+    }
+    std::thread writer([&] {
+        std::mt19937_64 rng(0);
+        while (!stop.load(std::memory_order_relaxed)) {
+            auto key = rng() % (2 * count);
+            if (!tree.try_add(key)) {
+                tree.try_remove(key);
+            }
+            ++writes;
+            // Roughly the pace of a stream of + and - commands
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    writer.join();
+    auto end = std::chrono::steady_clock::now();
+    auto seconds = std::chrono::duration<double>(end - start).count();
+    return {static_cast<double>(lookups.load()) / seconds,
+            static_cast<double>(writes) / seconds};
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+    std::chrono::milliseconds duration(argc > 2 ? std::stoul(argv[2]) : 1000);
+    size_t maxReaders = std::max(2u, std::thread::hardware_concurrency());
+
+    ConcurrentRBTree<uint64_t> concurrent;
+    SharedMutexTree shared;
+    std::mt19937_64 rng(2024);
+    for (size_t i = 0; i < count; ++i) {
+        auto key = rng() % (2 * count);
+        concurrent.try_add(key);
+        shared.try_add(key);
+    }
+
+    std::cout << "readers, ConcurrentRBTree lookups/s and writes/s, "
+                 "shared_mutex lookups/s and writes/s\n";
+    for (size_t readers = 1; readers <= maxReaders; readers *= 2) {
+        auto fast = measure(concurrent, count, readers, duration);
+        auto slow = measure(shared, count, readers, duration);
+        std::cout << readers << " " << fast.lookups << " " << fast.writes
+                  << " " << slow.lookups << " " << slow.writes << "\n";
+    }
+    std::cout << "checksum: " << hits.load() << "\n";
+    return 0;
+}
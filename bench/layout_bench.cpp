@@ -0,0 +1,130 @@
+#include <rb_tree.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+// Lookups in the same tree under different node layouts:
+//   scattered     - built by random adds with removals in between
+//   pre-order     - saved and read back by readFromBinary
+//   breadth-first - compact(BREADTH_FIRST) after loading
+//   van Emde Boas - compact(VAN_EMDE_BOAS) after loading
+// Each runs random hits one by one through try_find and in batches through
+// find_batch.
+// Usage: layout_bench [element count]
+
+using namespace rb_tree;
+
+struct Entry {
+    uint64_t key;
+    uint64_t value;
+
+    void serialize(std::ostream &os) const {
+        os.write(reinterpret_cast<const char *>(&key), sizeof(key));
+        os.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static Entry deserialize(std::istream &is) {
+        Entry entry;
+        is.read(reinterpret_cast<char *>(&entry.key), sizeof(entry.key));
+        is.read(reinterpret_cast<char *>(&entry.value), sizeof(entry.value));
+        return entry;
+    }
+};
+
+bool operator==(Entry const &a, Entry const &b) { return a.key == b.key; }
+auto operator<=>(Entry const &a, Entry const &b) { return a.key <=> b.key; }
+bool operator==(Entry const &a, uint64_t b) { return a.key == b; }
+auto operator<=>(Entry const &a, uint64_t b) { return a.key <=> b; }
+
+std::ostream &operator<<(std::ostream &os, Entry const &entry) {
+    return os << entry.key << " " << entry.value;
+}
+
+using Tree = RBTree<Entry, std::equal_to<>, ThreeWayLess<>>;
+
+template <typename Func>
+double measureNs(Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+void report(std::string const &name, double ns, size_t ops) {
+    std::cout << name << ": " << ns / static_cast<double>(ops) << " ns/op\n";
+}
+
+size_t run(std::string const &name, Tree const &tree,
+           std::vector<uint64_t> const &hits) {
+    size_t found = 0;
+    report(name + " find", measureNs([&] {
+               for (auto key : hits) {
+                   found += tree.try_find(key) != nullptr;
+               }
+           }),
+           hits.size());
+    std::vector<Entry const *> out(hits.size());
+    report(name + " find_batch", measureNs([&] {
+               tree.find_batch(std::span<uint64_t const>(hits),
+                               std::span<Entry const *>(out));
+           }),
+           hits.size());
+    found += static_cast<size_t>(
+        std::count_if(out.begin(), out.end(), [](auto p) { return p; }));
+    return found;
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 4'000'000;
+    std::mt19937_64 rng(42);
+
+    // A third more keys than kept, removed again in random order while
+    // adding, so that freed nodes get reused all over the heap
+    Tree scattered;
+    std::vector<uint64_t> keys;
+    for (size_t i = 0; i < count + count / 3; ++i) {
+        keys.push_back(rng());
+        scattered.try_add(Entry{keys.back(), i});
+        if (i % 4 == 3) {
+            std::uniform_int_distribution<size_t> pick(0, keys.size() - 1);
+            auto victim = pick(rng);
+            scattered.try_remove(keys[victim]);
+            keys[victim] = keys.back();
+            keys.pop_back();
+        }
+    }
+    std::vector<uint64_t> hits(count);
+    std::uniform_int_distribution<size_t> pick(0, keys.size() - 1);
+    for (auto &key : hits) {
+        key = keys[pick(rng)];
+    }
+
+    std::stringstream snapshot;
+    scattered.saveToBinary(snapshot);
+    auto load = [&snapshot] {
+        snapshot.clear();
+        snapshot.seekg(0);
+        return Tree::readFromBinary(snapshot);
+    };
+
+    size_t found = run("scattered", scattered, hits);
+    scattered.clear();
+    {
+        auto tree = load();
+        found += run("pre-order", tree, hits);
+    }
+    for (auto layout : {Tree::BREADTH_FIRST, Tree::VAN_EMDE_BOAS}) {
+        auto tree = load();
+        auto name = layout == Tree::BREADTH_FIRST ? "breadth-first"
+                                                  : "van Emde Boas";
+        report(std::string(name) + " compact",
+               measureNs([&] { tree.compact(layout); }), tree.size());
+        found += run(name, tree, hits);
+    }
+    std::cerr << "found: " << found << "\n";
+    return 0;
+}
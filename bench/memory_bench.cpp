@@ -0,0 +1,83 @@
+#include <b_tree.hpp>
+#include <rb_tree.hpp>
+
+#include <iostream>
+#include <memory_resource>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+// Heap bytes per entry of each container holding the same random keys,
+// counted by the memory resource that serves all of its allocations:
+// nodes, and for RBTree any control blocks that come with them.
+// Usage: memory_bench [element count]
+
+using namespace rb_tree;
+
+// 16 bytes, like a key with its value
+struct Entry {
+    uint64_t key;
+    uint64_t value;
+};
+
+bool operator==(Entry const &a, Entry const &b) { return a.key == b.key; }
+auto operator<=>(Entry const &a, Entry const &b) { return a.key <=> b.key; }
+
+class CountingResource : public std::pmr::memory_resource {
+  public:
+    std::size_t bytes() const { return live; }
+
+  private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        live += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *p, std::size_t bytes,
+                       std::size_t alignment) override {
+        live -= bytes;
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(
+        std::pmr::memory_resource const &other) const noexcept override {
+        return this == &other;
+    }
+
+    std::size_t live = 0;
+};
+
+template <typename Container>
+void report(std::string const &name, std::vector<uint64_t> const &keys) {
+    CountingResource resource;
+    Container container{std::pmr::polymorphic_allocator<Entry>(&resource)};
+    for (auto key : keys) {
+        container.insert(Entry{key, key});
+    }
+    auto bytes = static_cast<double>(resource.bytes());
+    std::cout << name << ": " << bytes / static_cast<double>(keys.size())
+              << " bytes/entry (" << sizeof(Entry) << " of them the entry)\n";
+}
+
+// Trees take values through add
+template <typename Tree>
+class Inserting : public Tree {
+  public:
+    using Tree::Tree;
+    void insert(Entry const &entry) { this->try_add(entry); }
+};
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 10'000'000;
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(count);
+    for (auto &key : keys) {
+        key = rng();
+    }
+
+    report<Inserting<pmr::RBTree<Entry>>>("RBTree", keys);
+    report<Inserting<pmr::BTree<Entry>>>("BTree", keys);
+    report<std::pmr::set<Entry>>("std::set", keys);
+    return 0;
+}
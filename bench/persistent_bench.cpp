@@ -0,0 +1,113 @@
+#include <rb_tree_persistent.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+// Cost of path copying in PersistentRBTree against the in-place RBTree, and
+// how long a save keeps the writer from serving commands: the whole
+// saveToBinary for RBTree, only taking a snapshot for PersistentRBTree.
+// Usage: persistent_bench [element count]
+
+using namespace rb_tree;
+
+struct Key {
+    uint64_t key;
+
+    void serialize(std::ostream &os) const {
+        os.write(reinterpret_cast<const char *>(&key), sizeof(key));
+    }
+
+    static Key deserialize(std::istream &is) {
+        Key key;
+        is.read(reinterpret_cast<char *>(&key.key), sizeof(key.key));
+        return key;
+    }
+
+    auto operator<=>(Key const &) const = default;
+    bool operator==(Key const &) const = default;
+};
+
+std::ostream &operator<<(std::ostream &os, Key const &k) {
+    return os << k.key;
+}
+
+template <typename Func>
+double measureNs(Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+void report(char const *name, double ns, size_t ops) {
+    std::cout << name << ": " << ns / static_cast<double>(ops) << " ns/op\n";
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+    std::mt19937_64 rng(2024);
+    std::vector<Key> keys(count);
+    for (auto &key : keys) {
+        key.key = rng();
+    }
+
+    RBTree<Key> tree;
+    PersistentRBTree<Key> persistent;
+    report("RBTree add", measureNs([&] {
+               for (auto const &key : keys) {
+                   tree.try_add(key);
+               }
+           }),
+           count);
+    report("PersistentRBTree add", measureNs([&] {
+               for (auto const &key : keys) {
+                   persistent.try_add(key);
+               }
+           }),
+           count);
+
+    size_t found = 0;
+    report("RBTree find", measureNs([&] {
+               for (auto const &key : keys) {
+                   found += tree.try_find(key) != nullptr;
+               }
+           }),
+           count);
+    report("PersistentRBTree find", measureNs([&] {
+               for (auto const &key : keys) {
+                   found += persistent.try_find(key) != nullptr;
+               }
+           }),
+           count);
+
+    // The writer is blocked for the whole save
+    std::stringstream stream;
+    auto blocked = measureNs([&] { tree.saveToBinary(stream); });
+    std::cout << "RBTree save blocks writer: " << blocked / 1e6 << " ms\n";
+
+    // The writer is blocked only while the snapshot is taken, then keeps
+    // removing keys while another thread saves the snapshot
+    std::stringstream persistentStream;
+    PersistentRBTree<Key> snapshot;
+    blocked = measureNs([&] { snapshot = persistent.snapshot(); });
+    std::thread saver([&] { snapshot.saveToBinary(persistentStream); });
+    auto removals = count / 2;
+    report("PersistentRBTree remove during save", measureNs([&] {
+               for (size_t i = 0; i < removals; ++i) {
+                   found += persistent.try_remove(keys[i]);
+               }
+           }),
+           removals);
+    saver.join();
+    std::cout << "PersistentRBTree save blocks writer: " << blocked / 1e6
+              << " ms\n";
+
+    auto loaded = RBTree<Key>::readFromBinary(persistentStream);
+    std::cout << "checksum: " << found << " " << loaded.size() << " "
+              << persistent.size() << "\n";
+    return 0;
+}
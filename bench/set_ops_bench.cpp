@@ -0,0 +1,136 @@
+#include <rb_tree_set_ops.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Union, intersection and difference of a tree of n random keys with one of
+// m keys, half of them shared with the first, for m from n down to n/1000:
+//   join-based - set_union, set_intersection and set_difference on a pool
+//                of one thread and on one thread per core
+//   one by one - try_add, try_find and try_remove of every key of the
+//                smaller tree into, in or from the larger one
+// Operands are built untimed and compacted, so that every run starts from
+// the same node layout however the heap has aged by then.
+// Usage: set_ops_bench [n]
+
+using namespace rb_tree;
+
+using Tree = RBTree<uint64_t, std::equal_to<>, ThreeWayLess<>>;
+
+template <typename Func>
+double measureMs(Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+struct Operands {
+    std::vector<uint64_t> large;
+    std::vector<uint64_t> small;
+};
+
+Operands makeOperands(std::size_t n, std::size_t m, std::mt19937_64 &rng) {
+    Operands operands;
+    for (std::size_t i = 0; i < n; ++i) {
+        operands.large.push_back(rng());
+    }
+    std::uniform_int_distribution<std::size_t> pick(0, n - 1);
+    for (std::size_t i = 0; i < m; ++i) {
+        operands.small.push_back(i % 2 ? rng() : operands.large[pick(rng)]);
+    }
+    for (auto keys : {&operands.large, &operands.small}) {
+        std::ranges::sort(*keys);
+        auto [first, last] = std::ranges::unique(*keys);
+        keys->erase(first, last);
+    }
+    return operands;
+}
+
+Tree build(std::vector<uint64_t> const &keys) {
+    auto tree = Tree::fromSorted(keys);
+    tree.compact();
+    return tree;
+}
+
+uint64_t run(std::string const &name, Operands const &operands,
+             TaskPool &pool) {
+    uint64_t checksum = 0;
+    double unite = 0, intersect = 0, subtract = 0;
+    for (int operation = 0; operation < 3; ++operation) {
+        auto large = build(operands.large);
+        auto small = build(operands.small);
+        Tree result;
+        auto ms = measureMs([&] {
+            if (operation == 0) {
+                result = Tree::set_union(std::move(large), std::move(small),
+                                         pool);
+            } else if (operation == 1) {
+                result = Tree::set_intersection(std::move(large),
+                                                std::move(small), pool);
+            } else {
+                result = Tree::set_difference(std::move(large),
+                                              std::move(small), pool);
+            }
+        });
+        (operation == 0 ? unite : operation == 1 ? intersect : subtract) = ms;
+        checksum += result.size();
+    }
+    std::cout << name << ": union " << unite << " ms, intersection "
+              << intersect << " ms, difference " << subtract << " ms\n";
+    return checksum;
+}
+
+uint64_t runOneByOne(Operands const &operands) {
+    uint64_t checksum = 0;
+    auto large = build(operands.large);
+    auto unite = measureMs([&] {
+        for (auto key : operands.small) {
+            checksum += large.try_add(key);
+        }
+    });
+    large = build(operands.large);
+    auto intersect = measureMs([&] {
+        for (auto key : operands.small) {
+            checksum += large.try_find(key) != nullptr;
+        }
+    });
+    auto subtract = measureMs([&] {
+        for (auto key : operands.small) {
+            checksum += large.try_remove(key);
+        }
+    });
+    std::cout << "one by one: union " << unite << " ms, intersection "
+              << intersect << " ms, difference " << subtract << " ms\n";
+    return checksum;
+}
+
+int main(int argc, char **argv) {
+    std::size_t n = argc > 1 ? std::stoul(argv[1]) : 4'000'000;
+    std::mt19937_64 rng(42);
+    TaskPool single(1);
+    TaskPool all(std::thread::hardware_concurrency());
+    uint64_t checksum = 0;
+    for (auto m : {n, n / 10, n / 100, n / 1000}) {
+        if (m == 0) {
+            continue;
+        }
+        auto operands = makeOperands(n, m, rng);
+        std::cout << "n = " << operands.large.size()
+                  << ", m = " << operands.small.size() << "\n";
+        checksum += run("join-based, 1 thread", operands, single);
+        if (all.size() > 1) {
+            checksum += run("join-based, " + std::to_string(all.size()) +
+                                " threads",
+                            operands, all);
+        }
+        checksum += runOneByOne(operands);
+    }
+    std::cerr << "checksum: " << checksum << "\n";
+    return 0;
+}
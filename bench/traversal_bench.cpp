@@ -0,0 +1,137 @@
+#include <rb_tree.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Measures the read-only walks of RBTree on a large tree of string keys:
+// lookups, insertion descent, iteration, serialization, comparison and
+// printing.
+// Usage: traversal_bench [element count]
+
+using namespace rb_tree;
+
+struct Word {
+    std::string key;
+
+    void serialize(std::ostream &os) const {
+        uint64_t len = key.size();
+        os.write(reinterpret_cast<const char *>(&len), sizeof(len));
+        os.write(key.data(), static_cast<std::streamsize>(len));
+    }
+
+    static Word deserialize(std::istream &is) {
+        uint64_t len;
+        is.read(reinterpret_cast<char *>(&len), sizeof(len));
+        Word word;
+        word.key.resize(len);
+        is.read(word.key.data(), static_cast<std::streamsize>(len));
+        return word;
+    }
+};
+
+bool operator==(Word const &a, Word const &b) { return a.key == b.key; }
+bool operator<(Word const &a, Word const &b) { return a.key < b.key; }
+std::ostream &operator<<(std::ostream &os, Word const &w) {
+    return os << w.key;
+}
+
+std::vector<Word> randomWords(size_t count, std::mt19937_64 &rng) {
+    std::uniform_int_distribution<int> letter('a', 'z');
+    std::vector<Word> words(count);
+    for (auto &word : words) {
+        word.key.resize(12);
+        for (auto &c : word.key) {
+            c = static_cast<char>(letter(rng));
+        }
+    }
+    return words;
+}
+
+template <typename Func>
+double measureNs(Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+void report(char const *name, double ns, size_t ops) {
+    std::cout << name << ": " << ns / static_cast<double>(ops) << " ns/op\n";
+}
+
+int main(int argc, char **argv) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+    std::mt19937_64 rng(2024);
+    auto words = randomWords(count, rng);
+    auto misses = randomWords(count, rng);
+
+    RBTree<Word> tree;
+    report("add", measureNs([&] {
+               for (auto const &word : words) {
+                   tree.try_add(word);
+               }
+           }),
+           count);
+
+    std::shuffle(words.begin(), words.end(), rng);
+    size_t found = 0;
+    report("find hit", measureNs([&] {
+               for (auto const &word : words) {
+                   found += tree.try_find(word) != nullptr;
+               }
+           }),
+           count);
+    report("find miss", measureNs([&] {
+               for (auto const &word : misses) {
+                   found += tree.try_find(word) != nullptr;
+               }
+           }),
+           count);
+    std::vector<Word const *> batchFound(count);
+    report("find_batch hit", measureNs([&] {
+               tree.find_batch(words, batchFound);
+           }),
+           count);
+    report("find_batch miss", measureNs([&] {
+               tree.find_batch(misses, batchFound);
+           }),
+           count);
+    report("add existing", measureNs([&] {
+               for (auto const &word : words) {
+                   found += tree.try_add(word);
+               }
+           }),
+           count);
+
+    uint64_t keyBytes = 0;
+    report("iterate", measureNs([&] {
+               for (auto const &word : tree) {
+                   keyBytes += word.key.size();
+               }
+           }),
+           tree.size());
+
+    std::stringstream stream;
+    report("saveToBinary", measureNs([&] { tree.saveToBinary(stream); }),
+           tree.size());
+    RBTree<Word> loaded;
+    report("readFromBinary", measureNs([&] {
+               loaded = RBTree<Word>::readFromBinary(stream);
+           }),
+           tree.size());
+    bool equal = false;
+    report("operator==", measureNs([&] { equal = tree == loaded; }),
+           tree.size());
+    std::ostringstream printed;
+    report("printTree", measureNs([&] { tree.printTree(printed); }),
+           tree.size());
+
+    std::cout << "checksum: " << found << " " << equal << " " << keyBytes
+              << "\n";
+    return 0;
+}
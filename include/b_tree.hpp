@@ -0,0 +1,1368 @@
+#ifndef B_TREE_HPP
+#define B_TREE_HPP
+
+#include "rb_tree.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <optional>
+#include <vector>
+
+namespace rb_tree {
+
+// B-tree with the public interface of RBTree, so the two can be swapped and
+// measured against each other. A node holds as many values as fit into
+// NodeBytes together with its child links and starts on a cache line, so a
+// lookup costs one miss per level of a much lower tree.
+//
+// Snapshots use the RBTree formats: values are written as the perfectly
+// balanced red-black tree fromSorted would build over them, so files move
+// freely between both trees.
+template <class T, typename EqualTo = std::equal_to<T>,
+          typename Less = std::less<T>, typename Allocator = std::allocator<T>,
+          std::size_t NodeBytes = 256>
+class BTree {
+  protected:
+    struct Node;
+    struct Inner;
+    class SortedBuilder;
+
+    static constexpr std::size_t cacheLine = 64;
+    // Every node but the root has between minDegree - 1 and
+    // 2 * minDegree - 1 values
+    static constexpr std::size_t minDegree = std::max<std::size_t>(
+        2, (NodeBytes / (sizeof(T) + sizeof(void *)) + 1) / 2);
+    static constexpr std::size_t maxKeys = 2 * minDegree - 1;
+
+  public:
+    using value_ptr = std::shared_ptr<T>;
+    using allocator_type = Allocator;
+
+    class const_iterator;
+    using iterator = const_iterator;
+
+    BTree() = default;
+    explicit BTree(Allocator const &alloc);
+    BTree(BTree &&other);
+    BTree(BTree const &) = delete;
+    ~BTree();
+
+    BTree &operator=(BTree &&other);
+
+    template <std::ranges::forward_range Range>
+        requires std::convertible_to<std::ranges::range_reference_t<Range>, T>
+    static BTree fromSorted(Range &&range,
+                            Allocator const &alloc = Allocator());
+    template <std::ranges::forward_range Range>
+        requires std::convertible_to<std::ranges::range_reference_t<Range>, T>
+    void assignSorted(Range &&range);
+
+    T const &find(T const &value) const;
+    void add(T const &value);
+    void add(T &&value);
+    // Values live inside shared nodes, so the removed one is handed out as
+    // a new object
+    value_ptr remove(T const &value);
+
+    T const *try_find(T const &value) const;
+    bool try_add(T const &value);
+    bool try_add(T &&value);
+    bool try_remove(T const &value);
+
+    // Same in-place additions as RBTree's
+    template <typename... Args>
+        requires std::constructible_from<T, Args...>
+    bool emplace(Args &&...args);
+    template <typename... Args>
+        requires std::constructible_from<T, Args...>
+    bool try_emplace(T const &key, Args &&...args);
+    template <typename Key, typename... Args>
+        requires Transparent<EqualTo> && Transparent<Less> &&
+                 std::constructible_from<T, Args...>
+    bool try_emplace(Key const &key, Args &&...args);
+    bool insert_or_assign(T const &value);
+    bool insert_or_assign(T &&value);
+
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    T const &find(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    value_ptr remove(Key const &key);
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    T const *try_find(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    bool try_remove(Key const &key);
+
+    static constexpr std::size_t batchWidth = 16;
+    void find_batch(std::span<T const> values, std::span<T const *> out) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    void find_batch(std::span<Key const> keys, std::span<T const *> out) const;
+
+    // In-order iteration. Any add or remove invalidates all iterators.
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+
+    bool empty() const;
+    uint64_t size() const;
+    void clear();
+
+    allocator_type get_allocator() const;
+
+    // Same values in the same order; node shapes are not compared
+    bool operator==(BTree const &other) const;
+
+    void saveToBinary(std::ostream &os) const
+        requires Serializable<T>;
+    static BTree readFromBinary(std::istream &is,
+                                Allocator const &alloc = Allocator())
+        requires Serializable<T>;
+
+    void saveToFlatBinary(std::ostream &os) const
+        requires FlatSerializable<T>;
+    static BTree readFromFlatBinary(std::span<char const> image,
+                                    Allocator const &alloc = Allocator())
+        requires FlatSerializable<T>;
+
+    void printTree(std::ostream &os) const;
+
+  protected:
+    using NodeAllocator = typename std::allocator_traits<
+        Allocator>::template rebind_alloc<Node>;
+    using InnerAllocator = typename std::allocator_traits<
+        Allocator>::template rebind_alloc<Inner>;
+
+    template <typename Key>
+    static auto compareKeys(T const &value, Key const &key);
+    // Position of the key in the node, or of the child to descend into
+    template <typename Key>
+    static std::pair<std::size_t, bool> locate(Node const *node,
+                                               Key const &key);
+    template <typename Key>
+    T const *findKey(Key const &key) const;
+    template <typename Key>
+    void findBatch(std::span<Key const> keys, std::span<T const *> out) const;
+    // Adds the value make() returns only if no element has the key. Gives
+    // back the element with the key and whether it was just added.
+    template <typename Key, typename Make>
+    std::pair<T *, bool> insertKey(Key const &key, Make &&make);
+    template <typename Key> std::optional<T> removeKey(Key const &key);
+    template <typename Key>
+    std::optional<T> removeFrom(Node *node, Key const &key);
+
+    static Inner *asInner(Node *node);
+    static Inner const *asInner(Node const *node);
+    static void insertAt(Node *node, std::size_t index, T &&value);
+    static T eraseAt(Node *node, std::size_t index);
+
+    Node *makeLeaf();
+    Inner *makeInner();
+    void freeNode(Node *node);
+
+    void splitChild(Inner *parent, std::size_t index);
+    void merge(Inner *parent, std::size_t index);
+    static void rotateLeft(Inner *parent, std::size_t index);
+    static void rotateRight(Inner *parent, std::size_t index);
+    Node *fill(Inner *parent, std::size_t index);
+    T takeMax(Node *node);
+    T takeMin(Node *node);
+
+    std::vector<T const *> sortedValues() const;
+    void move(BTree &&other);
+
+  protected:
+    Node *root = nullptr;
+    uint64_t _size = 0;
+    Allocator alloc;
+};
+
+namespace pmr {
+template <class T, typename EqualTo = std::equal_to<T>,
+          typename Less = std::less<T>, std::size_t NodeBytes = 256>
+using BTree = rb_tree::BTree<T, EqualTo, Less,
+                             std::pmr::polymorphic_allocator<T>, NodeBytes>;
+}; // namespace pmr
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+struct alignas(BTree<T, EqualTo, Less, Allocator, NodeBytes>::cacheLine)
+    BTree<T, EqualTo, Less, Allocator, NodeBytes>::Node {
+    explicit Node(bool leaf) : leaf(leaf) {}
+
+    // Only the first count slots hold values
+    T *keys() { return std::launder(reinterpret_cast<T *>(slots)); }
+    T const *keys() const {
+        return std::launder(reinterpret_cast<T const *>(slots));
+    }
+
+    uint16_t count = 0;
+    bool const leaf;
+    alignas(T) std::byte slots[maxKeys * sizeof(T)];
+};
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+struct BTree<T, EqualTo, Less, Allocator, NodeBytes>::Inner : Node {
+    Inner() : Node(false) {}
+
+    std::array<Node *, maxKeys + 1> children{};
+};
+
+// Builds a tree from increasing values in O(n). Values are appended to the
+// rightmost leaf; a full leaf passes the next value up as a separator and a
+// fresh rightmost path starts below it. Nodes left behind are full, so the
+// short nodes on the final right spine can borrow from them at the end.
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+class BTree<T, EqualTo, Less, Allocator, NodeBytes>::SortedBuilder {
+  public:
+    explicit SortedBuilder(BTree &tree) : tree(tree) {}
+
+    // False if the value is not greater than the previous one
+    bool append(T &&value);
+    void finish();
+
+  private:
+    BTree &tree;
+    std::vector<Node *> path;
+    T const *last = nullptr;
+};
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+class BTree<T, EqualTo, Less, Allocator, NodeBytes>::const_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T const *;
+    using reference = T const &;
+
+    const_iterator() = default;
+
+    reference operator*() const;
+    pointer operator->() const;
+
+    const_iterator &operator++();
+    const_iterator operator++(int);
+
+    bool operator==(const_iterator const &other) const;
+
+  private:
+    friend class BTree;
+
+    void pushLeftSpine(Node const *node);
+
+    // Every entry is a node and the value of it that comes next
+    std::vector<std::pair<Node const *, std::size_t>> path;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// BTree class methods implementation
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+BTree<T, EqualTo, Less, Allocator, NodeBytes>::BTree(Allocator const &alloc)
+    : alloc(alloc) {}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+BTree<T, EqualTo, Less, Allocator, NodeBytes>::BTree(BTree &&other)
+    : alloc(other.alloc) {
+    move(std::move(other));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+BTree<T, EqualTo, Less, Allocator, NodeBytes>::~BTree() {
+    clear();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::operator=(BTree &&other)
+    -> BTree & {
+    if (this != &other) {
+        clear();
+        move(std::move(other));
+    }
+    return *this;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::move(BTree &&other) {
+    // Nodes have to go back to the allocator that made them, so they can
+    // only be taken over from an equal one
+    if (alloc == other.alloc) {
+        root = other.root;
+        _size = other._size;
+        other.root = nullptr;
+        other._size = 0;
+        return;
+    }
+    SortedBuilder builder(*this);
+    for (auto value : other.sortedValues()) {
+        builder.append(T(std::move(*const_cast<T *>(value))));
+    }
+    builder.finish();
+    _size = other._size;
+    other.clear();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <std::ranges::forward_range Range>
+    requires std::convertible_to<std::ranges::range_reference_t<Range>, T>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::fromSorted(
+    Range &&range, Allocator const &alloc) -> BTree {
+    BTree tree(alloc);
+    SortedBuilder builder(tree);
+    for (auto &&value : range) {
+        if (!builder.append(T(value))) {
+            throw InputNotSorted(
+                "Error: input is not sorted or has duplicates");
+        }
+        ++tree._size;
+    }
+    builder.finish();
+    return tree;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <std::ranges::forward_range Range>
+    requires std::convertible_to<std::ranges::range_reference_t<Range>, T>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::assignSorted(
+    Range &&range) {
+    *this = fromSorted(std::forward<Range>(range), alloc);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::find(T const &value) const
+    -> T const & {
+    auto found = findKey(value);
+    if (!found) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return *found;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::add(T const &value) {
+    if (!try_add(value)) {
+        throw TreeHasGivenElement("Error: tree has element with given value");
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::add(T &&value) {
+    if (!try_add(std::move(value))) {
+        throw TreeHasGivenElement("Error: tree has element with given value");
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::remove(T const &value)
+    -> value_ptr {
+    if (empty()) {
+        throw TreeEmpty("Error: can not remove node from empty RBTree!");
+    }
+    auto removed = removeKey(value);
+    if (!removed) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return std::allocate_shared<T>(alloc, std::move(*removed));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::try_find(
+    T const &value) const -> T const * {
+    return findKey(value);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::try_add(T const &value) {
+    return insertKey(value, [&value] { return value; }).second;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::try_add(T &&value) {
+    return insertKey(value, [&value] { return std::move(value); }).second;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename... Args>
+    requires std::constructible_from<T, Args...>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::emplace(Args &&...args) {
+    return try_add(T(std::forward<Args>(args)...));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename... Args>
+    requires std::constructible_from<T, Args...>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::try_emplace(
+    T const &key, Args &&...args) {
+    return insertKey(key, [&] { return T(std::forward<Args>(args)...); })
+        .second;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key, typename... Args>
+    requires Transparent<EqualTo> && Transparent<Less> &&
+             std::constructible_from<T, Args...>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::try_emplace(
+    Key const &key, Args &&...args) {
+    return insertKey(key, [&] { return T(std::forward<Args>(args)...); })
+        .second;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::insert_or_assign(
+    T const &value) {
+    auto [slot, added] = insertKey(value, [&value] { return value; });
+    if (!added) {
+        *slot = value;
+    }
+    return added;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::insert_or_assign(
+    T &&value) {
+    auto [slot, added] =
+        insertKey(value, [&value] { return std::move(value); });
+    if (!added) {
+        *slot = std::move(value);
+    }
+    return added;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::try_remove(
+    T const &value) {
+    return removeKey(value).has_value();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::find(Key const &key) const
+    -> T const & {
+    auto found = findKey(key);
+    if (!found) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return *found;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::remove(Key const &key)
+    -> value_ptr {
+    if (empty()) {
+        throw TreeEmpty("Error: can not remove node from empty RBTree!");
+    }
+    auto removed = removeKey(key);
+    if (!removed) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return std::allocate_shared<T>(alloc, std::move(*removed));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::try_find(
+    Key const &key) const -> T const * {
+    return findKey(key);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::try_remove(
+    Key const &key) {
+    return removeKey(key).has_value();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::find_batch(
+    std::span<T const> values, std::span<T const *> out) const {
+    findBatch(values, out);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::find_batch(
+    std::span<Key const> keys, std::span<T const *> out) const {
+    findBatch(keys, out);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::begin() const
+    -> const_iterator {
+    const_iterator it;
+    it.pushLeftSpine(root && root->count > 0 ? root : nullptr);
+    return it;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::end() const
+    -> const_iterator {
+    return const_iterator();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::cbegin() const
+    -> const_iterator {
+    return begin();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::cend() const
+    -> const_iterator {
+    return end();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::empty() const {
+    return _size == 0;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+uint64_t BTree<T, EqualTo, Less, Allocator, NodeBytes>::size() const {
+    return _size;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::clear() {
+    std::vector<Node *> stack;
+    if (root) {
+        stack.push_back(root);
+    }
+    while (!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+        if (!node->leaf) {
+            auto inner = asInner(node);
+            for (std::size_t i = 0; i <= node->count; ++i) {
+                if (inner->children[i]) {
+                    stack.push_back(inner->children[i]);
+                }
+            }
+        }
+        freeNode(node);
+    }
+    root = nullptr;
+    _size = 0;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::get_allocator() const
+    -> allocator_type {
+    return alloc;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::operator==(
+    BTree const &other) const {
+    return _size == other._size &&
+           std::equal(begin(), end(), other.begin(), EqualTo());
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::saveToBinary(
+    std::ostream &os) const
+    requires Serializable<T>
+{
+    uint64_t size = _size;
+    os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    // Pre-order over the balanced shape with a marker for every missing
+    // child; the last, partial level is red as in RBTree::fromSorted
+    auto values = sortedValues();
+    auto redDepth = static_cast<uint64_t>(std::bit_width(size + 1) - 1);
+    struct Range {
+        uint64_t first;
+        uint64_t count;
+        uint64_t depth;
+    };
+    std::vector<Range> stack{{0, size, 0}};
+    while (!stack.empty()) {
+        auto [first, count, depth] = stack.back();
+        stack.pop_back();
+        bool exists = count > 0;
+        os.write(reinterpret_cast<const char *>(&exists), sizeof(exists));
+        if (exists) {
+            auto leftCount = (count - 1) / 2;
+            char color = depth == redDepth ? 1 : 0;
+            os.write(&color, sizeof(color));
+            values[first + leftCount]->serialize(os);
+            stack.push_back(
+                {first + leftCount + 1, count - 1 - leftCount, depth + 1});
+            stack.push_back({first, leftCount, depth + 1});
+        }
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::readFromBinary(
+    std::istream &is, Allocator const &alloc) -> BTree
+    requires Serializable<T>
+{
+    BTree tree(alloc);
+    uint64_t size = 0;
+    is.read(reinterpret_cast<char *>(&size), sizeof(size));
+    // A node is passed on once its left subtree has been read, which
+    // turns pre-order into sorted order
+    SortedBuilder builder(tree);
+    std::vector<T> pending;
+    while (is) {
+        bool exists;
+        is.read(reinterpret_cast<char *>(&exists), sizeof(exists));
+        if (exists) {
+            char color;
+            is.read(&color, sizeof(color));
+            pending.push_back(T::deserialize(is));
+            continue;
+        }
+        if (pending.empty()) {
+            break;
+        }
+        if (!builder.append(std::move(pending.back()))) {
+            throw SnapshotCorrupted("Error: snapshot is not sorted");
+        }
+        pending.pop_back();
+        ++tree._size;
+    }
+    builder.finish();
+    return tree;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::saveToFlatBinary(
+    std::ostream &os) const
+    requires FlatSerializable<T>
+{
+    using FlatEntry = FlatSnapshotEntry<typename T::FlatRecord>;
+    auto values = sortedValues();
+    std::vector<FlatEntry> entries;
+    entries.reserve(values.size());
+    std::string blob;
+    auto redDepth =
+        static_cast<uint64_t>(std::bit_width(values.size() + 1) - 1);
+    struct Range {
+        uint64_t first;
+        uint64_t count;
+        uint64_t depth;
+    };
+    std::vector<Range> stack;
+    if (!values.empty()) {
+        stack.push_back({0, values.size(), 0});
+    }
+    while (!stack.empty()) {
+        auto [first, count, depth] = stack.back();
+        stack.pop_back();
+        auto leftCount = (count - 1) / 2;
+        auto rightCount = count - 1 - leftCount;
+        FlatEntry entry;
+        // Padding is part of the checksum, so it has to be deterministic
+        std::memset(&entry, 0, sizeof(entry));
+        entry.record = values[first + leftCount]->toFlat(blob);
+        entry.color = depth == redDepth ? 1 : 0;
+        entry.children =
+            static_cast<uint8_t>((leftCount ? FlatEntry::HAS_LEFT : 0) |
+                                 (rightCount ? FlatEntry::HAS_RIGHT : 0));
+        entries.push_back(entry);
+        if (rightCount) {
+            stack.push_back({first + leftCount + 1, rightCount, depth + 1});
+        }
+        if (leftCount) {
+            stack.push_back({first, leftCount, depth + 1});
+        }
+    }
+    writeFlatSnapshot(os,
+                      std::span<char const>(
+                          reinterpret_cast<char const *>(entries.data()),
+                          entries.size() * sizeof(FlatEntry)),
+                      sizeof(FlatEntry), entries.size(), blob);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::readFromFlatBinary(
+    std::span<char const> image, Allocator const &alloc) -> BTree
+    requires FlatSerializable<T>
+{
+    using FlatEntry = FlatSnapshotEntry<typename T::FlatRecord>;
+    auto [count, records, blob] = openFlatSnapshot(image, sizeof(FlatEntry));
+
+    BTree tree(alloc);
+    SortedBuilder builder(tree);
+    auto append = [&](T &&value) {
+        if (!builder.append(std::move(value))) {
+            throw SnapshotCorrupted("Error: snapshot is not sorted");
+        }
+        ++tree._size;
+    };
+    // Nodes with a left subtree wait for it; whether a right subtree follows
+    // decides how far up a finished subtree returns
+    std::vector<std::pair<T, bool>> pending;
+    bool expectMore = count > 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        FlatEntry entry;
+        std::memcpy(&entry, records.data() + i * sizeof(FlatEntry),
+                    sizeof(FlatEntry));
+        if (!expectMore || entry.color > 1) {
+            throw SnapshotCorrupted("Error: snapshot has invalid structure");
+        }
+        auto value = T::fromFlat(entry.record, blob);
+        bool hasRight = entry.children & FlatEntry::HAS_RIGHT;
+        if (entry.children & FlatEntry::HAS_LEFT) {
+            pending.emplace_back(std::move(value), hasRight);
+            continue;
+        }
+        append(std::move(value));
+        expectMore = hasRight;
+        while (!expectMore && !pending.empty()) {
+            append(std::move(pending.back().first));
+            expectMore = pending.back().second;
+            pending.pop_back();
+        }
+    }
+    if (expectMore || !pending.empty()) {
+        throw SnapshotCorrupted("Error: snapshot has invalid structure");
+    }
+    builder.finish();
+    return tree;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::printTree(
+    std::ostream &os) const {
+    // Pre-order, one node per line, children indented below their parent
+    std::vector<std::pair<Node const *, int>> stack;
+    if (root && root->count > 0) {
+        stack.emplace_back(root, 0);
+    }
+    while (!stack.empty()) {
+        auto [node, indent] = stack.back();
+        stack.pop_back();
+        if (indent) {
+            os << std::setw(indent) << ' ';
+        }
+        os << "(";
+        for (std::size_t i = 0; i < node->count; ++i) {
+            os << (i ? ", " : "") << node->keys()[i];
+        }
+        os << ")\n";
+        if (!node->leaf) {
+            for (auto i = static_cast<std::ptrdiff_t>(node->count); i >= 0;
+                 --i) {
+                stack.emplace_back(
+                    asInner(node)->children[static_cast<std::size_t>(i)],
+                    indent + 4);
+            }
+        }
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::compareKeys(
+    T const &value, Key const &key) {
+    return compareWith<EqualTo, Less>(value, key);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::locate(Node const *node,
+                                                           Key const &key)
+    -> std::pair<std::size_t, bool> {
+    std::size_t low = 0;
+    std::size_t high = node->count;
+    auto keys = node->keys();
+    while (low < high) {
+        auto middle = (low + high) / 2;
+        auto order = compareKeys(keys[middle], key);
+        if (order == 0) {
+            return {middle, true};
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return {low, false};
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::findKey(
+    Key const &key) const -> T const * {
+    Node const *node = root;
+    while (node) {
+        auto [index, found] = locate(node, key);
+        if (found) {
+            return &node->keys()[index];
+        }
+        node = node->leaf ? nullptr : asInner(node)->children[index];
+    }
+    return nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::findBatch(
+    std::span<Key const> keys, std::span<T const *> out) const {
+    if (out.size() < keys.size()) {
+        throw BatchSizeMismatch("Error: batch output is shorter than input");
+    }
+    // Same round-robin over descents as RBTree::find_batch
+    for (std::size_t first = 0; first < keys.size(); first += batchWidth) {
+        auto count = std::min(batchWidth, keys.size() - first);
+        std::array<Node const *, batchWidth> cursors;
+        for (std::size_t i = 0; i < count; ++i) {
+            cursors[i] = root;
+            out[first + i] = nullptr;
+        }
+        for (auto active = count; active > 0;) {
+            active = 0;
+            for (std::size_t i = 0; i < count; ++i) {
+                auto node = cursors[i];
+                if (!node) {
+                    continue;
+                }
+                auto [index, found] = locate(node, keys[first + i]);
+                if (found) {
+                    out[first + i] = &node->keys()[index];
+                    cursors[i] = nullptr;
+                    continue;
+                }
+                node = node->leaf ? nullptr : asInner(node)->children[index];
+#if defined(__GNUC__) || defined(__clang__)
+                if (node) {
+                    __builtin_prefetch(node);
+                    __builtin_prefetch(
+                        reinterpret_cast<char const *>(node) + cacheLine);
+                }
+#endif
+                cursors[i] = node;
+                active += node != nullptr;
+            }
+        }
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key, typename Make>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::insertKey(Key const &key,
+                                                              Make &&make)
+    -> std::pair<T *, bool> {
+    if (!root) {
+        root = makeLeaf();
+    }
+    // Full nodes are split on the way down, so there is always room for the
+    // separator a split passes up
+    if (root->count == maxKeys) {
+        auto top = makeInner();
+        top->children[0] = root;
+        root = top;
+        splitChild(top, 0);
+    }
+    auto node = root;
+    while (true) {
+        auto [index, found] = locate(node, key);
+        if (found) {
+            return {&node->keys()[index], false};
+        }
+        if (node->leaf) {
+            insertAt(node, index, make());
+            ++_size;
+            return {&node->keys()[index], true};
+        }
+        auto inner = asInner(node);
+        if (inner->children[index]->count == maxKeys) {
+            splitChild(inner, index);
+            auto order = compareKeys(inner->keys()[index], key);
+            if (order == 0) {
+                return {&inner->keys()[index], false};
+            }
+            if (order < 0) {
+                ++index;
+            }
+        }
+        node = inner->children[index];
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::removeKey(Key const &key)
+    -> std::optional<T> {
+    if (!root) {
+        return std::nullopt;
+    }
+    auto removed = removeFrom(root, key);
+    // The root is the only node allowed to run empty; then its single
+    // child takes over
+    if (root->count == 0) {
+        auto old = root;
+        root = root->leaf ? nullptr : asInner(root)->children[0];
+        freeNode(old);
+    }
+    if (removed) {
+        --_size;
+    }
+    return removed;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+template <typename Key>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::removeFrom(
+    Node *node, Key const &key) -> std::optional<T> {
+    // Every node entered below the root has at least minDegree values, so
+    // taking one away never needs to look back up
+    while (true) {
+        auto [index, found] = locate(node, key);
+        if (node->leaf) {
+            if (!found) {
+                return std::nullopt;
+            }
+            return eraseAt(node, index);
+        }
+        auto inner = asInner(node);
+        if (!found) {
+            node = fill(inner, index);
+            continue;
+        }
+        auto left = inner->children[index];
+        auto right = inner->children[index + 1];
+        if (left->count >= minDegree) {
+            T removed = std::move(node->keys()[index]);
+            node->keys()[index] = takeMax(left);
+            return removed;
+        }
+        if (right->count >= minDegree) {
+            T removed = std::move(node->keys()[index]);
+            node->keys()[index] = takeMin(right);
+            return removed;
+        }
+        // Both neighbours are minimal: pull the value down between them
+        merge(inner, index);
+        node = left;
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::asInner(Node *node)
+    -> Inner * {
+    return static_cast<Inner *>(node);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::asInner(Node const *node)
+    -> Inner const * {
+    return static_cast<Inner const *>(node);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::insertAt(Node *node,
+                                                             std::size_t index,
+                                                             T &&value) {
+    auto keys = node->keys();
+    for (std::size_t i = node->count; i > index; --i) {
+        std::construct_at(keys + i, std::move(keys[i - 1]));
+        std::destroy_at(keys + i - 1);
+    }
+    std::construct_at(keys + index, std::move(value));
+    ++node->count;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+T BTree<T, EqualTo, Less, Allocator, NodeBytes>::eraseAt(Node *node,
+                                                         std::size_t index) {
+    auto keys = node->keys();
+    T value = std::move(keys[index]);
+    std::destroy_at(keys + index);
+    for (std::size_t i = index; i + 1 < node->count; ++i) {
+        std::construct_at(keys + i, std::move(keys[i + 1]));
+        std::destroy_at(keys + i + 1);
+    }
+    --node->count;
+    return value;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::makeLeaf() -> Node * {
+    NodeAllocator nodeAlloc(alloc);
+    using Traits = std::allocator_traits<NodeAllocator>;
+    auto node = Traits::allocate(nodeAlloc, 1);
+    Traits::construct(nodeAlloc, node, true);
+    return node;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::makeInner() -> Inner * {
+    InnerAllocator innerAlloc(alloc);
+    using Traits = std::allocator_traits<InnerAllocator>;
+    auto node = Traits::allocate(innerAlloc, 1);
+    Traits::construct(innerAlloc, node);
+    return node;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::freeNode(Node *node) {
+    // Children are not touched
+    std::destroy_n(node->keys(), node->count);
+    if (node->leaf) {
+        NodeAllocator nodeAlloc(alloc);
+        std::allocator_traits<NodeAllocator>::destroy(nodeAlloc, node);
+        std::allocator_traits<NodeAllocator>::deallocate(nodeAlloc, node, 1);
+    } else {
+        InnerAllocator innerAlloc(alloc);
+        auto inner = asInner(node);
+        std::allocator_traits<InnerAllocator>::destroy(innerAlloc, inner);
+        std::allocator_traits<InnerAllocator>::deallocate(innerAlloc, inner,
+                                                          1);
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::splitChild(
+    Inner *parent, std::size_t index) {
+    // The full child keeps its lower half, the upper half moves to a new
+    // right sibling and the middle value goes up between them
+    auto child = parent->children[index];
+    Node *sibling = child->leaf ? makeLeaf() : makeInner();
+    auto keys = child->keys();
+    for (std::size_t i = 0; i < minDegree - 1; ++i) {
+        std::construct_at(sibling->keys() + i,
+                          std::move(keys[minDegree + i]));
+        std::destroy_at(keys + minDegree + i);
+    }
+    sibling->count = minDegree - 1;
+    if (!child->leaf) {
+        std::copy_n(asInner(child)->children.begin() + minDegree, minDegree,
+                    asInner(sibling)->children.begin());
+    }
+    T middle = std::move(keys[minDegree - 1]);
+    std::destroy_at(keys + minDegree - 1);
+    child->count = minDegree - 1;
+
+    insertAt(parent, index, std::move(middle));
+    auto &children = parent->children;
+    std::copy_backward(children.begin() + static_cast<std::ptrdiff_t>(index) +
+                           1,
+                       children.begin() + parent->count,
+                       children.begin() + parent->count + 1);
+    children[index + 1] = sibling;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::merge(Inner *parent,
+                                                          std::size_t index) {
+    // Left child, separator and right child become one node
+    auto left = parent->children[index];
+    auto right = parent->children[index + 1];
+    insertAt(left, left->count, eraseAt(parent, index));
+    auto keys = right->keys();
+    for (std::size_t i = 0; i < right->count; ++i) {
+        std::construct_at(left->keys() + left->count + i, std::move(keys[i]));
+        std::destroy_at(keys + i);
+    }
+    if (!left->leaf) {
+        std::copy_n(asInner(right)->children.begin(), right->count + 1,
+                    asInner(left)->children.begin() + left->count);
+    }
+    left->count = static_cast<uint16_t>(left->count + right->count);
+    right->count = 0;
+
+    auto &children = parent->children;
+    std::copy(children.begin() + static_cast<std::ptrdiff_t>(index) + 2,
+              children.begin() + parent->count + 2,
+              children.begin() + static_cast<std::ptrdiff_t>(index) + 1);
+    freeNode(right);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::rotateLeft(
+    Inner *parent, std::size_t index) {
+    // The child at index borrows through the parent from its right sibling
+    auto child = parent->children[index];
+    auto right = parent->children[index + 1];
+    insertAt(child, child->count, std::move(parent->keys()[index]));
+    parent->keys()[index] = eraseAt(right, 0);
+    if (!child->leaf) {
+        auto &rightChildren = asInner(right)->children;
+        asInner(child)->children[child->count] = rightChildren[0];
+        std::copy(rightChildren.begin() + 1,
+                  rightChildren.begin() + right->count + 2,
+                  rightChildren.begin());
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator, NodeBytes>::rotateRight(
+    Inner *parent, std::size_t index) {
+    // The child at index + 1 borrows through the parent from its left
+    // sibling
+    auto left = parent->children[index];
+    auto child = parent->children[index + 1];
+    insertAt(child, 0, std::move(parent->keys()[index]));
+    parent->keys()[index] = eraseAt(left, left->count - 1u);
+    if (!child->leaf) {
+        auto &children = asInner(child)->children;
+        std::copy_backward(children.begin(), children.begin() + child->count,
+                           children.begin() + child->count + 1);
+        children[0] = asInner(left)->children[left->count + 1u];
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::fill(Inner *parent,
+                                                         std::size_t index)
+    -> Node * {
+    // Makes sure the child at index has a value to spare before entering
+    // it; returns the child that now covers its range
+    auto child = parent->children[index];
+    if (child->count >= minDegree) {
+        return child;
+    }
+    if (index > 0 && parent->children[index - 1]->count >= minDegree) {
+        rotateRight(parent, index - 1);
+        return child;
+    }
+    if (index < parent->count &&
+        parent->children[index + 1]->count >= minDegree) {
+        rotateLeft(parent, index);
+        return child;
+    }
+    if (index < parent->count) {
+        merge(parent, index);
+        return child;
+    }
+    merge(parent, index - 1);
+    return parent->children[index - 1];
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+T BTree<T, EqualTo, Less, Allocator, NodeBytes>::takeMax(Node *node) {
+    while (!node->leaf) {
+        node = fill(asInner(node), node->count);
+    }
+    return eraseAt(node, node->count - 1u);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+T BTree<T, EqualTo, Less, Allocator, NodeBytes>::takeMin(Node *node) {
+    while (!node->leaf) {
+        node = fill(asInner(node), 0);
+    }
+    return eraseAt(node, 0);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator, NodeBytes>::sortedValues() const
+    -> std::vector<T const *> {
+    std::vector<T const *> values;
+    values.reserve(_size);
+    for (auto it = begin(); it != end(); ++it) {
+        values.push_back(&*it);
+    }
+    return values;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// SortedBuilder class methods implementation
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator, NodeBytes>::SortedBuilder::append(
+    T &&value) {
+    if (last && compareKeys(*last, value) >= 0) {
+        return false;
+    }
+    if (path.empty()) {
+        tree.root = tree.makeLeaf();
+        path.push_back(tree.root);
+    }
+    auto leaf = path.back();
+    if (leaf->count < maxKeys) {
+        insertAt(leaf, leaf->count, std::move(value));
+        last = &leaf->keys()[leaf->count - 1];
+        return true;
+    }
+    // The lowest ancestor with room takes the value as a separator
+    auto level = path.size() - 1;
+    while (level > 0 && path[level - 1]->count == maxKeys) {
+        --level;
+    }
+    if (level == 0) {
+        auto top = tree.makeInner();
+        top->children[0] = tree.root;
+        tree.root = top;
+        path.insert(path.begin(), top);
+    } else {
+        --level;
+    }
+    auto owner = path[level];
+    insertAt(owner, owner->count, std::move(value));
+    last = &owner->keys()[owner->count - 1];
+    for (auto i = level + 1; i < path.size(); ++i) {
+        Node *next = i + 1 == path.size() ? tree.makeLeaf() : tree.makeInner();
+        asInner(path[i - 1])->children[path[i - 1]->count] = next;
+        path[i] = next;
+    }
+    return true;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator,
+           NodeBytes>::SortedBuilder::finish() {
+    // Top down, so that a node is complete before its last child borrows
+    // through it
+    for (std::size_t i = 0; i + 1 < path.size(); ++i) {
+        auto parent = asInner(path[i]);
+        while (path[i + 1]->count < minDegree - 1) {
+            rotateRight(parent, parent->count - 1u);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// const_iterator class methods implementation
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator,
+           NodeBytes>::const_iterator::operator*() const -> reference {
+    auto [node, index] = path.back();
+    return node->keys()[index];
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator,
+           NodeBytes>::const_iterator::operator->() const -> pointer {
+    return &**this;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator,
+           NodeBytes>::const_iterator::operator++() -> const_iterator & {
+    auto &[node, index] = path.back();
+    ++index;
+    if (!node->leaf) {
+        pushLeftSpine(asInner(node)->children[index]);
+        return *this;
+    }
+    while (!path.empty() && path.back().second == path.back().first->count) {
+        path.pop_back();
+    }
+    return *this;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+auto BTree<T, EqualTo, Less, Allocator,
+           NodeBytes>::const_iterator::operator++(int) -> const_iterator {
+    auto old = *this;
+    ++*this;
+    return old;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+bool BTree<T, EqualTo, Less, Allocator,
+           NodeBytes>::const_iterator::operator==(const_iterator const &other)
+    const {
+    if (path.empty() || other.path.empty()) {
+        return path.empty() == other.path.empty();
+    }
+    return path.back() == other.path.back();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator,
+          std::size_t NodeBytes>
+void BTree<T, EqualTo, Less, Allocator,
+           NodeBytes>::const_iterator::pushLeftSpine(Node const *node) {
+    while (node) {
+        path.emplace_back(node, 0);
+        node = node->leaf ? nullptr : asInner(node)->children[0];
+    }
+}
+
+}; // namespace rb_tree
+
+#endif
@@ -7,21 +7,111 @@
 #endif
 
 #include "rb_tree_exceptions.hpp"
+#include "rb_tree_hash_index.hpp"
+#include "rb_tree_node_pool.hpp"
+#include "rb_tree_snapshot.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <compare>
+#include <cstdint>
 #include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <memory_resource>
+#include <ranges>
+#include <span>
+#include <vector>
 
 namespace rb_tree {
 
+class TaskPool;
+
 template <typename T>
 concept Serializable = requires(T t, std::ostream &os, std::istream &is) {
     { t.serialize(os) } -> std::same_as<void>;
     { T::deserialize(is) } -> std::same_as<T>;
 };
 
+// Comparators that declare is_transparent can compare stored values with
+// other key types, which lets lookups skip building a T
+template <typename Compare>
+concept Transparent = requires { typename Compare::is_transparent; };
+
+// A Less that also provides compare(a, b) returning an ordering lets the tree
+// decide "equal, go left or go right" with a single comparison per node
+template <typename Compare, typename A, typename B>
+concept ThreeWayComparator = requires(Compare compare, A const &a,
+                                      B const &b) {
+    { compare.compare(a, b) } -> std::convertible_to<std::partial_ordering>;
+};
+
+template <typename T = void>
+struct ThreeWayLess {
+    auto compare(T const &a, T const &b) const { return a <=> b; }
+    bool operator()(T const &a, T const &b) const { return (a <=> b) < 0; }
+};
+
+template <>
+struct ThreeWayLess<void> {
+    using is_transparent = void;
+
+    template <typename A, typename B>
+    auto compare(A const &a, B const &b) const {
+        return a <=> b;
+    }
+
+    template <typename A, typename B>
+    bool operator()(A const &a, B const &b) const {
+        return (a <=> b) < 0;
+    }
+};
+
+// Hash of a value for the side index built with RBTREE_HASH_INDEX. A
+// specialization that also takes lookup keys lets heterogeneous finds use
+// the index too; a key has to hash like the values equal to it.
+template <typename T>
+struct IndexHash : std::hash<T> {};
+
+template <typename T, typename Key = T>
+concept IndexHashable =
+    std::default_initializable<IndexHash<T>> &&
+    requires(IndexHash<T> const &hash, Key const &key) {
+        { hash(key) } -> std::convertible_to<std::size_t>;
+    };
+
+// Orders a stored value against a key: one call for a ThreeWayComparator,
+// otherwise EqualTo first and then Less
+template <typename EqualTo, typename Less, typename A, typename B>
+auto compareWith(A const &value, B const &key) {
+    if constexpr (ThreeWayComparator<Less, A, B>) {
+        return Less().compare(value, key);
+    } else {
+        if (EqualTo()(value, key)) {
+            return std::weak_ordering::equivalent;
+        }
+        return Less()(value, key) ? std::weak_ordering::less
+                                  : std::weak_ordering::greater;
+    }
+}
+
+// Work done by the trees of one type and the shape of one tree, see
+// RBTree::stats()
+struct TreeStats {
+    uint64_t compares = 0;
+    uint64_t rotations = 0;
+    uint64_t recolors = 0;
+    uint64_t allocations = 0;
+    uint64_t height = 0;
+    // depths[d]: number of nodes d links below the root
+    std::vector<uint64_t> depths;
+};
+
 template <class T, typename EqualTo = std::equal_to<T>,
-          typename Less = std::less<T>>
+          typename Less = std::less<T>, typename Allocator = std::allocator<T>>
 class RBTree {
   protected:
     // Node information
@@ -29,59 +119,398 @@ class RBTree {
     enum ChildSide { LEFT, RIGHT };
 
     class Node;
-    using node_ptr = std::shared_ptr<Node>;
-    using wnode_ptr = std::weak_ptr<Node>;
+    using node_ptr = Node *;
 
   public:
     using value_ptr = std::shared_ptr<T>;
+    using allocator_type = Allocator;
 
-    RBTree() = default;
-    RBTree(RBTree<T, EqualTo, Less> &&other);
-
-    RBTree &operator=(RBTree<T, EqualTo, Less> &&other);
+    // Values are the keys, so they are never modifiable through an iterator
+    class const_iterator;
+    using iterator = const_iterator;
 
-    value_ptr find(T const &value) const;
+    RBTree() = default;
+    explicit RBTree(Allocator const &alloc);
+    RBTree(RBTree &&other);
+    ~RBTree();
+
+    RBTree &operator=(RBTree &&other);
+
+    // Builds a tree from strictly increasing values in O(n) without
+    // rotations; throws InputNotSorted otherwise
+    template <std::ranges::forward_range Range>
+        requires std::convertible_to<std::ranges::range_reference_t<Range>, T>
+    static RBTree fromSorted(Range &&range,
+                             Allocator const &alloc = Allocator());
+    template <std::ranges::forward_range Range>
+        requires std::convertible_to<std::ranges::range_reference_t<Range>, T>
+    void assignSorted(Range &&range);
+
+    // find_copy and remove hand out values apart from the tree, in handles
+    // from the global heap, so they outlive the tree and its allocator.
+    // There is deliberately no handle sharing a stored value: the tree
+    // owns its nodes outright, destroys a value as soon as it is removed,
+    // even inside a compact() block, and moves values when it compacts.
+    // Sharing would take a count in every node. PersistentRBTree's
+    // find_shared does share, since its nodes are reference counted anyway.
+    T const &find(T const &value) const;
+    value_ptr find_copy(T const &value) const;
     void add(T const &value);
+    void add(T &&value);
     value_ptr remove(T const &value);
+
+    // Non-throwing counterparts: a miss or a duplicate is reported through
+    // the return value instead of an exception
+    T const *try_find(T const &value) const;
+    bool try_add(T const &value);
+    bool try_add(T &&value);
+    bool try_remove(T const &value);
+
+    // In-place additions, all returning whether an element was added.
+    // emplace builds the value from args and drops it if its key is taken.
+    // try_emplace looks the key up first and builds the value only if the
+    // key is absent, so args have to make a value equal to key. The key is
+    // a T unless both comparators are transparent.
+    // insert_or_assign overwrites the element with an equal key, if any,
+    // within the same descent.
+    template <typename... Args>
+        requires std::constructible_from<T, Args...>
+    bool emplace(Args &&...args);
+    template <typename... Args>
+        requires std::constructible_from<T, Args...>
+    bool try_emplace(T const &key, Args &&...args);
+    template <typename Key, typename... Args>
+        requires Transparent<EqualTo> && Transparent<Less> &&
+                 std::constructible_from<T, Args...>
+    bool try_emplace(Key const &key, Args &&...args);
+    bool insert_or_assign(T const &value);
+    bool insert_or_assign(T &&value);
+
+    // Heterogeneous lookup by any key the comparators accept
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    T const &find(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    value_ptr find_copy(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    value_ptr remove(Key const &key);
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    T const *try_find(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    bool try_remove(Key const &key);
+
+    // With RBTREE_HASH_INDEX, trees of values IndexHash can hash also keep
+    // a hash table from keys to nodes: find, try_find, find_copy and
+    // find_batch by value, or by any key IndexHash takes, go through it in
+    // O(1) instead of descending. Everything ordered still uses the tree.
+
+    // Looks every key up and stores the found value or nullptr at the same
+    // position of out. Up to batchWidth descents advance in turns and each
+    // prefetches its next node, so the cache misses of different keys
+    // overlap instead of following one another.
+    static constexpr std::size_t batchWidth = 16;
+    void find_batch(std::span<T const> values, std::span<T const *> out) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    void find_batch(std::span<Key const> keys, std::span<T const *> out) const;
+
+#ifdef RBTREE_ORDER_STATISTICS
+    // Order statistics over the subtree sizes kept in every node. Only
+    // compiled in with RBTREE_ORDER_STATISTICS, otherwise nodes carry no
+    // extra field and updates do no extra work.
+    //
+    // rank: number of elements less than the key; select: the element with
+    // the given zero-based position; countRange: elements in [low, high]
+    uint64_t rank(T const &value) const;
+    T const &select(uint64_t index) const;
+    uint64_t countRange(T const &low, T const &high) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    uint64_t rank(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    uint64_t countRange(Key const &low, Key const &high) const;
+#endif
+
+#ifdef RBTREE_STATS
+    // Counters of key comparisons, rotations, recolorings and node
+    // allocations made by every tree of this type since the last
+    // resetStats(), along with the height and depth histogram of this tree.
+    // Only compiled in with RBTREE_STATS; without it the counting calls are
+    // empty and vanish.
+    TreeStats stats() const;
+    static void resetStats();
+#endif
+
+    // In-order iteration. Any add or remove invalidates all iterators.
+    const_iterator begin() const;
+    const_iterator end() const;
+    const_iterator cbegin() const;
+    const_iterator cend() const;
+
+    // First element not less than / greater than the key
+    const_iterator lower_bound(T const &value) const;
+    const_iterator upper_bound(T const &value) const;
+    std::pair<const_iterator, const_iterator>
+    equal_range(T const &value) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    const_iterator lower_bound(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    const_iterator upper_bound(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    std::pair<const_iterator, const_iterator>
+    equal_range(Key const &key) const;
+
+    // Calls callback for every element in [from, to] in order. A callback
+    // that returns bool can stop the scan early by returning false.
+    template <typename Callback>
+    void scan(T const &from, T const &to, Callback &&callback) const;
+    template <typename Key, typename Callback>
+        requires Transparent<EqualTo> && Transparent<Less>
+    void scan(Key const &from, Key const &to, Callback &&callback) const;
+
     bool empty() const;
     uint64_t size() const;
     void clear();
 
-    bool operator==(RBTree<T, EqualTo, Less> const &other) const;
+    // Moves every node into one contiguous block, ordered so that a descent
+    // touches few cache lines and pages: level by level, or van Emde Boas,
+    // where each half of the levels is laid out recursively as a unit and
+    // subtrees of any height end up close to their root without tuning for
+    // a block size. Values are moved, so pointers to them and iterators are
+    // invalidated. Later additions allocate nodes one by one again; the
+    // block is given back by clear() or the next compact(), once no tree
+    // split or merged from this one holds nodes in it either.
+    enum Layout { BREADTH_FIRST, VAN_EMDE_BOAS };
+    void compact(Layout layout = VAN_EMDE_BOAS);
+
+    // Join-based bulk operations (Blelloch, Ferizovic and Sun, "Just Join
+    // for Parallel Ordered Sets"). The operands are taken apart and their
+    // nodes relinked, so they are left empty and no value is copied, unless
+    // the allocators differ and the second operand is first copied into
+    // the first one's. With m and n the sizes of the smaller and the larger
+    // operand:
+    //   join: every element of left has to be less than every element of
+    //     right, otherwise it throws InputNotSorted; O(log n)
+    //   split: elements less than the key go to first, the rest to second;
+    //     O(log n), plus counting the smaller half for its size unless
+    //     RBTREE_ORDER_STATISTICS keeps sizes in the nodes
+    //   set_union, set_intersection, set_difference: O(m log(n/m + 1))
+    //     comparisons, an element of a winning over an equal one of b. The
+    //     two halves of the recursion run in parallel on the pool once both
+    //     operands are large. Dropped nodes are freed by the calling thread
+    //     at the end, so the allocator need not be thread-safe, but the
+    //     comparators must not throw. They are defined in
+    //     rb_tree_set_ops.hpp, so only its users pull in the thread pool.
+    // With RBTREE_HASH_INDEX the results rebuild their index in O(size).
+    static RBTree join(RBTree &&left, RBTree &&right);
+    std::pair<RBTree, RBTree> split(T const &value);
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    std::pair<RBTree, RBTree> split(Key const &key);
+    template <typename Pool = TaskPool>
+    static RBTree set_union(RBTree &&a, RBTree &&b,
+                            Pool &pool = Pool::shared());
+    template <typename Pool = TaskPool>
+    static RBTree set_intersection(RBTree &&a, RBTree &&b,
+                                   Pool &pool = Pool::shared());
+    template <typename Pool = TaskPool>
+    static RBTree set_difference(RBTree &&a, RBTree &&b,
+                                 Pool &pool = Pool::shared());
+
+    allocator_type get_allocator() const;
+
+    bool operator==(RBTree const &other) const;
 
     void saveToBinary(std::ostream &os) const
         requires Serializable<T>;
-    static RBTree<T, EqualTo, Less> readFromBinary(std::istream &is)
+    static RBTree readFromBinary(std::istream &is,
+                                 Allocator const &alloc = Allocator())
         requires Serializable<T>;
 
-    static void printTree(std::ostream &os, node_ptr root, int ident = 0);
+    // Flat snapshot: one contiguous record array plus a data blob, see
+    // rb_tree_snapshot.hpp. Loading makes a single pass over a mapped image.
+    void saveToFlatBinary(std::ostream &os) const
+        requires FlatSerializable<T>;
+    static RBTree readFromFlatBinary(std::span<char const> image,
+                                     Allocator const &alloc = Allocator())
+        requires FlatSerializable<T>;
+
+    static void printTree(std::ostream &os, node_ptr const &root,
+                          int ident = 0);
     void printTree(std::ostream &os) const;
 
   protected:
     class AdditionMethodImplementation;
     class RemovalMethodImplementation;
 
-    static bool subtreesEqual(node_ptr r1, node_ptr r2);
-    static node_ptr findInSubtree(node_ptr root, T const &value);
+    static bool subtreesEqual(node_ptr const &r1, node_ptr const &r2);
+    template <typename Key>
+    static node_ptr const *findInSubtree(node_ptr const &root,
+                                         Key const &key);
+    template <typename Key>
+    static auto compareKeys(T const &value, Key const &key);
+    template <typename Key>
+    void findBatch(std::span<Key const> keys, std::span<T const *> out) const;
+    template <typename Key> T const *lookup(Key const &key) const;
+    static void prefetch(Node const *node);
+
+    static void saveToBinarySubtree(std::ostream &os, node_ptr const &node);
+    void readSubtreeFromBinary(std::istream &is);
+
+#ifdef RBTREE_ORDER_STATISTICS
+    template <typename Key>
+    uint64_t countBelow(Key const &key, bool inclusive) const;
+    static uint64_t subtreeSize(node_ptr const &node);
+    static void updateSubtreeSize(node_ptr const &node);
+    static void recountSubtreeSizes(node_ptr const &root);
+#endif
 
-    static void saveToBinarySubtree(std::ostream &os, node_ptr node);
-    static node_ptr readSubtreeFromBinary(std::istream &is);
+    template <typename Key>
+    const_iterator boundOf(Key const &key, bool inclusive) const;
+    template <typename Key, typename Callback>
+    void scanRange(Key const &from, Key const &to, Callback &callback) const;
+
+    template <typename Key> static uint64_t hashOf(Key const &key);
+    void indexNode(node_ptr node);
+    void unindexNode(node_ptr node);
+    void rebuildIndex();
+
+    enum Counter { COMPARES, ROTATIONS, RECOLORS, ALLOCATIONS, COUNTERS };
+    static void tally(Counter counter, uint64_t times = 1);
+#ifdef RBTREE_STATS
+    // Shared by every tree of this type, since a tree is read from many
+    // threads
+    static std::array<std::atomic<uint64_t>, COUNTERS> counters;
+#endif
 
+    using NodeAllocator =
+        typename std::allocator_traits<Allocator>::template rebind_alloc<Node>;
+    using NodeTraits = std::allocator_traits<NodeAllocator>;
+
+    node_ptr makeNode(Color color, T value);
+    void destroyNode(node_ptr node);
+    void destroySubtree(node_ptr node);
+    value_ptr release(node_ptr node);
+    bool inBlock(node_ptr node) const;
+    void adoptBlocks(RBTree &other);
+
+    static uint64_t heightOf(node_ptr root);
+    static void layoutBreadthFirst(node_ptr root,
+                                   std::vector<node_ptr> &order);
+    static void layoutVanEmdeBoas(node_ptr node, uint64_t height,
+                                  std::vector<node_ptr> &order,
+                                  std::vector<node_ptr> &scratch);
+    static void collectAtDepth(node_ptr node, uint64_t depth,
+                               std::vector<node_ptr> &out);
+    template <typename Iterator>
+    node_ptr buildSorted(Iterator &it, uint64_t count, uint64_t depth,
+                         uint64_t redDepth, Node const *&last);
     node_ptr rightRotate(node_ptr node);
     node_ptr leftRotate(node_ptr node);
 
-    void move(RBTree<T, EqualTo, Less> &&other);
+    // A detached subtree with a black root, and its black height
+    struct Piece {
+        node_ptr root = nullptr;
+        uint64_t height = 0;
+    };
+    // A piece cut at a key: what is less, the node holding it, if any,
+    // and what is greater
+    struct Cut {
+        Piece less;
+        node_ptr match;
+        Piece greater;
+    };
+    // What one branch of a set operation hands back besides its result:
+    // subtrees to free and the number of keys found in both operands
+    struct Leftovers {
+        std::vector<node_ptr> dropped;
+        uint64_t matches = 0;
+    };
+    enum SetOperation { UNION, INTERSECTION, DIFFERENCE };
+    // Pieces of at least this black height, so at least 2^8 - 1 nodes, are
+    // worth handing to another thread
+    static constexpr uint64_t parallelHeight = 8;
+
+    Piece detach();
+    template <typename Pool>
+    static RBTree combineTrees(SetOperation operation, RBTree &&a,
+                               RBTree &&b, Pool &pool);
+    template <typename Pool>
+    static Piece combine(SetOperation operation, Piece a, Piece b,
+                         Pool &pool, Leftovers &leftovers);
+    template <typename Key>
+    std::pair<RBTree, RBTree> splitAt(Key const &key);
+    static uint64_t countFirst(node_ptr first, node_ptr second,
+                               uint64_t total);
+
+    static Piece pieceOf(node_ptr root, uint64_t height);
+    static void link(node_ptr node, node_ptr left, node_ptr right);
+    static node_ptr rotateLeftAt(node_ptr node);
+    static node_ptr rotateRightAt(node_ptr node);
+    static node_ptr joinRight(node_ptr node, uint64_t height,
+                              node_ptr middle, Piece right);
+    static node_ptr joinLeft(Piece left, node_ptr middle, node_ptr node,
+                             uint64_t height);
+    static Piece joinPieces(Piece left, node_ptr middle, Piece right);
+    static Piece joinPieces(Piece left, Piece right);
+    static std::pair<Piece, node_ptr> splitLast(Piece piece);
+    template <typename Key>
+    static Cut cutPiece(Piece piece, Key const &key);
+
+    void move(RBTree &&other);
 
   protected:
-    node_ptr root;
-    uint64_t _size;
+    node_ptr root = nullptr;
+    uint64_t _size = 0;
+    // Every node is given back to this allocator, so nodes only move
+    // between trees whose allocators compare equal
+    Allocator alloc;
+    // Blocks of nodes placed by compact(). Such nodes are freed together
+    // with their block, once no tree refers to it: trees built by join,
+    // split and the set operations share the blocks of their operands.
+    struct Block {
+        std::shared_ptr<Node> nodes;
+        uint64_t size;
+    };
+    std::vector<Block> blocks;
+#ifdef RBTREE_HASH_INDEX
+    HashIndex<Node *, Allocator> index{alloc};
+#endif
 };
 
-template <class T, typename EqualTo, typename Less>
-class RBTree<T, EqualTo, Less>::Node {
+namespace pmr {
+template <class T, typename EqualTo = std::equal_to<T>,
+          typename Less = std::less<T>>
+using RBTree =
+    rb_tree::RBTree<T, EqualTo, Less, std::pmr::polymorphic_allocator<T>>;
+}; // namespace pmr
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+class RBTree<T, EqualTo, Less, Allocator>::Node {
   public:
-    Node(Color color, value_ptr value)
-        : color(color), value(value), id(++count) {}
+    Node(Color color, T value)
+        : parentAndColor(static_cast<std::uintptr_t>(color)),
+          value(std::move(value))
+#ifdef RBTREE_NODE_IDS
+          ,
+          id(count.fetch_add(1, std::memory_order_relaxed) + 1)
+#endif
+    {
+        static_assert(alignof(Node) > colorBit);
+    }
+
+    Node *parent() const;
+    void setParent(Node *parent);
+    Color color() const;
+    void setColor(Color color);
 
     bool operator==(Node const &other) const;
 
@@ -94,40 +523,108 @@ class RBTree<T, EqualTo, Less>::Node {
     static bool leftIsTheOne(node_ptr node, T const &value);
     static bool rightIsTheOne(node_ptr node, T const &value);
     void serialize(std::ostream &os) const;
-    static node_ptr deserialize(std::istream &is);
 
   public:
-    node_ptr left;
-    node_ptr right;
-    wnode_ptr parent;
-    Color color;
-    value_ptr value;
+    node_ptr left = nullptr;
+    node_ptr right = nullptr;
+    // Nodes are at least pointer-aligned, so the lowest bit of the parent's
+    // address is always zero and holds the color instead
+    std::uintptr_t parentAndColor;
+    T value;
+#ifdef RBTREE_ORDER_STATISTICS
+    uint64_t subtreeSize = 1;
+#endif
 
-    static size_t count;
+#ifdef RBTREE_NODE_IDS
+    // Debugging aid, off by default: shared by every tree of this type,
+    // which may live in other threads
+    static std::atomic<size_t> count;
     size_t const id;
+#endif
+
+  private:
+    static constexpr std::uintptr_t colorBit = 1;
 };
 
-template <class T, typename EqualTo, typename Less>
-size_t RBTree<T, EqualTo, Less>::Node::count = 0;
+#ifdef RBTREE_NODE_IDS
+template <class T, typename EqualTo, typename Less, typename Allocator>
+std::atomic<size_t> RBTree<T, EqualTo, Less, Allocator>::Node::count = 0;
+#endif
+
+#ifdef RBTREE_STATS
+template <class T, typename EqualTo, typename Less, typename Allocator>
+std::array<std::atomic<uint64_t>,
+           RBTree<T, EqualTo, Less, Allocator>::COUNTERS>
+    RBTree<T, EqualTo, Less, Allocator>::counters{};
+#endif
+
+// Just the current node: nodes link to their parents, so stepping climbs
+// through them and an iterator costs no allocation
+template <class T, typename EqualTo, typename Less, typename Allocator>
+class RBTree<T, EqualTo, Less, Allocator>::const_iterator {
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T const *;
+    using reference = T const &;
+
+    const_iterator() = default;
 
-template <class T, typename EqualTo, typename Less>
-class RBTree<T, EqualTo, Less>::AdditionMethodImplementation {
+    reference operator*() const;
+    pointer operator->() const;
+
+    const_iterator &operator++();
+    const_iterator operator++(int);
+    const_iterator &operator--();
+    const_iterator operator--(int);
+
+    bool operator==(const_iterator const &other) const;
+
+  private:
+    friend class RBTree;
+
+    const_iterator(Node const *node, Node const *root);
+
+    static Node const *leftmost(Node const *node);
+    static Node const *rightmost(Node const *node);
+
+    // Null at end()
+    Node const *node = nullptr;
+    // Needed to step back from end()
+    Node const *root = nullptr;
+};
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+class RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation {
   protected:
     RBTree *const tree;
 
   public:
-    AdditionMethodImplementation(RBTree<T, EqualTo, Less> *const tree)
-        : tree(tree) {}
+    AdditionMethodImplementation(RBTree *const tree) : tree(tree) {}
 
-    void run(T const &value);
+    // Descends by key and adds the value make() returns only if no
+    // element has that key. Gives back the node holding the key and
+    // whether it was just added.
+    template <typename Key, typename Make>
+    std::pair<node_ptr, bool> run(Key const &key, Make &&make);
 
   protected:
+    // Where a descent by key ended: at the node holding the key, or at the
+    // leaf parent with the side the key belongs on
+    struct Position {
+        node_ptr node;
+        bool found;
+        ChildSide side;
+    };
+
     void balanceFrom(node_ptr node);
     node_ptr leftChildParentCaseBalance(node_ptr node);
     node_ptr rightChildParentCaseBalance(node_ptr node);
     void restoreRootProperty();
 
-    node_ptr findLeafParentInSubtree(node_ptr root, T const &value);
+    template <typename Key>
+    static Position findLeafParentInSubtree(node_ptr root, Key const &key);
 
     static node_ptr recolorParentAndGrandfather(node_ptr node);
     static node_ptr recolorParentAndUncleAndGrandfather(node_ptr node);
@@ -141,23 +638,20 @@ class RBTree<T, EqualTo, Less>::AdditionMethodImplementation {
     static bool leftChildNodeCase(node_ptr node);
     static bool rightChildNodeCase(node_ptr node);
 
-    node_ptr makeNode(Color color, T const &value);
-    node_ptr addToLeafOfSubtree(node_ptr root, T const &value);
-    node_ptr addNodeToLeaf(node_ptr node, T const &value);
-    node_ptr addNodeToLeftLeaf(node_ptr node, T const &value);
-    node_ptr addNodeToRightLeaf(node_ptr node, T const &value);
+    node_ptr addNodeToLeaf(node_ptr node, ChildSide side, T &&value);
+    node_ptr addNodeToLeftLeaf(node_ptr node, T &&value);
+    node_ptr addNodeToRightLeaf(node_ptr node, T &&value);
 };
 
-template <class T, typename EqualTo, typename Less>
-class RBTree<T, EqualTo, Less>::RemovalMethodImplementation {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+class RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation {
   protected:
     RBTree *const tree;
 
   public:
-    RemovalMethodImplementation(RBTree<T, EqualTo, Less> *const tree)
-        : tree(tree) {}
+    RemovalMethodImplementation(RBTree *const tree) : tree(tree) {}
 
-    value_ptr run(T const &value);
+    template <typename Key> node_ptr run(Key const &key);
 
   protected:
     node_ptr removeNode(node_ptr node);
@@ -177,8 +671,12 @@ class RBTree<T, EqualTo, Less>::RemovalMethodImplementation {
     node_ptr removeChildlessNode(node_ptr);
     node_ptr removeNodeWithOneChild(node_ptr);
     node_ptr removeNodeWithTwoChildren(node_ptr);
+    void swapWithLeastLargestNode(node_ptr node, node_ptr next);
 
     static node_ptr findLeastLargestNodeFromNodeWithTwoChildren(node_ptr);
+
+  protected:
+    ChildSide removedSide = LEFT;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -187,121 +685,929 @@ class RBTree<T, EqualTo, Less>::RemovalMethodImplementation {
 #ifdef RB_TREE_HPP
 #define RB_TREE_HPP
 
-template <class T, typename EqualTo, typename Less>
-RBTree<T, EqualTo, Less>::RBTree(RBTree &&other) {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+RBTree<T, EqualTo, Less, Allocator>::RBTree(Allocator const &alloc)
+    : alloc(alloc) {}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+RBTree<T, EqualTo, Less, Allocator>::RBTree(RBTree &&other)
+    : alloc(other.alloc) {
     move(std::move(other));
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::operator=(RBTree<T, EqualTo, Less> &&other)
+template <class T, typename EqualTo, typename Less, typename Allocator>
+RBTree<T, EqualTo, Less, Allocator>::~RBTree() {
+    clear();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::operator=(RBTree &&other)
     -> RBTree & {
-    move(std::move(other));
+    if (this != &other) {
+        clear();
+        move(std::move(other));
+    }
     return *this;
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::move(RBTree &&other) {
-    root = other.root;
-    _size = other._size;
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <std::ranges::forward_range Range>
+    requires std::convertible_to<std::ranges::range_reference_t<Range>, T>
+auto RBTree<T, EqualTo, Less, Allocator>::fromSorted(Range &&range,
+                                                     Allocator const &alloc)
+    -> RBTree {
+    RBTree tree(alloc);
+    auto count = static_cast<uint64_t>(std::ranges::distance(range));
+    // Halving keeps every level but the last one full; coloring that last,
+    // partial level red gives all paths the same number of black nodes
+    auto redDepth = static_cast<uint64_t>(std::bit_width(count + 1) - 1);
+    auto it = std::ranges::begin(range);
+    Node const *last = nullptr;
+    tree.root = tree.buildSorted(it, count, 0, redDepth, last);
+    tree._size = count;
+    tree.rebuildIndex();
+    return tree;
+}
 
-    other.root = nullptr;
-    other._size = 0;
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <std::ranges::forward_range Range>
+    requires std::convertible_to<std::ranges::range_reference_t<Range>, T>
+void RBTree<T, EqualTo, Less, Allocator>::assignSorted(Range &&range) {
+    // Built aside, so the tree is left untouched if the input is not sorted
+    *this = fromSorted(std::forward<Range>(range), alloc);
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::find(T const &value) const -> value_ptr {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Iterator>
+auto RBTree<T, EqualTo, Less, Allocator>::buildSorted(Iterator &it,
+                                                      uint64_t count,
+                                                      uint64_t depth,
+                                                      uint64_t redDepth,
+                                                      Node const *&last)
+    -> node_ptr {
+    if (count == 0) {
+        return nullptr;
+    }
+    // In-order, so the input is consumed strictly front to back; the
+    // recursion is only as deep as the resulting tree
+    auto leftCount = (count - 1) / 2;
+    auto left = buildSorted(it, leftCount, depth + 1, redDepth, last);
+    node_ptr node;
     try {
-        node_ptr node = findInSubtree(root, value);
-        return node->value;
-    } catch (NoSuchElementInSubtree const &e) {
+        node = makeNode(depth == redDepth ? RED : BLACK, *it);
+    } catch (...) {
+        destroySubtree(left);
+        throw;
+    }
+    ++it;
+    if (last && compareKeys(last->value, node->value) >= 0) {
+        destroySubtree(left);
+        destroyNode(node);
+        throw InputNotSorted("Error: input is not sorted or has duplicates");
+    }
+    last = node;
+    node->left = left;
+    try {
+        node->right =
+            buildSorted(it, count - 1 - leftCount, depth + 1, redDepth, last);
+    } catch (...) {
+        destroySubtree(node);
+        throw;
+    }
+#ifdef RBTREE_ORDER_STATISTICS
+    node->subtreeSize = count;
+#endif
+    if (node->left) {
+        node->left->setParent(node);
+    }
+    if (node->right) {
+        node->right->setParent(node);
+    }
+    return node;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::move(RBTree &&other) {
+    // Expects this tree to be empty
+    if (alloc == other.alloc) {
+        root = other.root;
+        _size = other._size;
+
+        other.root = nullptr;
+        other._size = 0;
+        blocks = std::move(other.blocks);
+        other.blocks.clear();
+#ifdef RBTREE_HASH_INDEX
+        index = std::move(other.index);
+#endif
+        return;
+    }
+    // Nodes cannot change allocators, so the values are copied over
+    auto copy = fromSorted(other, alloc);
+    std::swap(root, copy.root);
+    std::swap(_size, copy._size);
+#ifdef RBTREE_HASH_INDEX
+    index = std::move(copy.index);
+#endif
+    other.clear();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::find(T const &value) const
+    -> T const & {
+    auto found = try_find(value);
+    if (!found) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return *found;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::find_copy(T const &value) const
+    -> value_ptr {
+    auto found = lookup(value);
+    if (!found) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return std::make_shared<T>(*found);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::add(T const &value) {
+    if (!try_add(value)) {
+        throw TreeHasGivenElement("Error: tree has element with given value");
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::add(T &&value) {
+    if (!try_add(std::move(value))) {
+        throw TreeHasGivenElement("Error: tree has element with given value");
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::remove(T const &value)
+    -> value_ptr {
+    if (empty()) {
+        throw TreeEmpty("Error: can not remove node from empty RBTree!");
+    }
+    RemovalMethodImplementation impl(this);
+    auto node = impl.run(value);
+    if (!node) {
         throw NoSuchElement("Error: no such element in RBTree!");
     }
+    return release(node);
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::add(T const &value) {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::try_find(T const &value) const
+    -> T const * {
+    return lookup(value);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::try_add(T const &value) {
     AdditionMethodImplementation impl(this);
-    impl.run(value);
+    return impl.run(value, [&value] { return value; }).second;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::remove(T const &value) -> value_ptr {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::try_add(T &&value) {
+    AdditionMethodImplementation impl(this);
+    return impl.run(value, [&value] { return std::move(value); }).second;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename... Args>
+    requires std::constructible_from<T, Args...>
+bool RBTree<T, EqualTo, Less, Allocator>::emplace(Args &&...args) {
+    return try_add(T(std::forward<Args>(args)...));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename... Args>
+    requires std::constructible_from<T, Args...>
+bool RBTree<T, EqualTo, Less, Allocator>::try_emplace(T const &key,
+                                                      Args &&...args) {
+    AdditionMethodImplementation impl(this);
+    return impl.run(key, [&] { return T(std::forward<Args>(args)...); })
+        .second;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key, typename... Args>
+    requires Transparent<EqualTo> && Transparent<Less> &&
+             std::constructible_from<T, Args...>
+bool RBTree<T, EqualTo, Less, Allocator>::try_emplace(Key const &key,
+                                                      Args &&...args) {
+    AdditionMethodImplementation impl(this);
+    return impl.run(key, [&] { return T(std::forward<Args>(args)...); })
+        .second;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::insert_or_assign(T const &value) {
+    AdditionMethodImplementation impl(this);
+    auto [node, added] = impl.run(value, [&value] { return value; });
+    if (!added) {
+        node->value = value;
+    }
+    return added;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::insert_or_assign(T &&value) {
+    AdditionMethodImplementation impl(this);
+    auto [node, added] =
+        impl.run(value, [&value] { return std::move(value); });
+    if (!added) {
+        // Equal keys, so the node keeps its place
+        node->value = std::move(value);
+    }
+    return added;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::try_remove(T const &value) {
     RemovalMethodImplementation impl(this);
-    return impl.run(value);
+    auto node = impl.run(value);
+    destroyNode(node);
+    return node != nullptr;
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::empty() const {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto RBTree<T, EqualTo, Less, Allocator>::find(Key const &key) const
+    -> T const & {
+    auto found = try_find(key);
+    if (!found) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return *found;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto RBTree<T, EqualTo, Less, Allocator>::find_copy(Key const &key) const
+    -> value_ptr {
+    auto found = lookup(key);
+    if (!found) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return std::make_shared<T>(*found);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto RBTree<T, EqualTo, Less, Allocator>::remove(Key const &key)
+    -> value_ptr {
+    if (empty()) {
+        throw TreeEmpty("Error: can not remove node from empty RBTree!");
+    }
+    RemovalMethodImplementation impl(this);
+    auto node = impl.run(key);
+    if (!node) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return release(node);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto RBTree<T, EqualTo, Less, Allocator>::try_find(Key const &key) const
+    -> T const * {
+    return lookup(key);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+bool RBTree<T, EqualTo, Less, Allocator>::try_remove(Key const &key) {
+    RemovalMethodImplementation impl(this);
+    auto node = impl.run(key);
+    destroyNode(node);
+    return node != nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::find_batch(
+    std::span<T const> values, std::span<T const *> out) const {
+    findBatch(values, out);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+void RBTree<T, EqualTo, Less, Allocator>::find_batch(
+    std::span<Key const> keys, std::span<T const *> out) const {
+    findBatch(keys, out);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::empty() const {
     return !root;
 }
 
-template <class T, typename EqualTo, typename Less>
-uint64_t RBTree<T, EqualTo, Less>::size() const {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::size() const {
     return _size;
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::operator==(
-    RBTree<T, EqualTo, Less> const &other) const {
-    return subtreesEqual(root, other.root);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::get_allocator() const
+    -> allocator_type {
+    return alloc;
+}
+
+#ifdef RBTREE_STATS
+template <class T, typename EqualTo, typename Less, typename Allocator>
+TreeStats RBTree<T, EqualTo, Less, Allocator>::stats() const {
+    TreeStats stats;
+    stats.compares = counters[COMPARES].load(std::memory_order_relaxed);
+    stats.rotations = counters[ROTATIONS].load(std::memory_order_relaxed);
+    stats.recolors = counters[RECOLORS].load(std::memory_order_relaxed);
+    stats.allocations = counters[ALLOCATIONS].load(std::memory_order_relaxed);
+    // The shape is measured on demand, so keeping it costs nothing
+    std::vector<std::pair<Node const *, std::size_t>> stack;
+    if (root) {
+        stack.emplace_back(root, 0);
+    }
+    while (!stack.empty()) {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+        if (stats.depths.size() <= depth) {
+            stats.depths.resize(depth + 1);
+        }
+        ++stats.depths[depth];
+        for (auto child : {node->left, node->right}) {
+            if (child) {
+                stack.emplace_back(child, depth + 1);
+            }
+        }
+    }
+    stats.height = stats.depths.size();
+    return stats;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::resetStats() {
+    for (auto &counter : counters) {
+        counter.store(0, std::memory_order_relaxed);
+    }
+}
+#endif
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::operator==(
+    RBTree const &other) const {
+    return subtreesEqual(root, other.root);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::printTree(std::ostream &os,
+                                                    node_ptr const &root,
+                                                    int indent) {
+    // Reverse in-order walk: right subtree, node, left subtree
+    std::vector<std::pair<Node const *, int>> stack;
+    auto pushRightSpine = [&stack](Node const *node, int indent) {
+        for (; node; node = node->right, indent += 4) {
+            stack.emplace_back(node, indent);
+        }
+    };
+    pushRightSpine(root, indent);
+    while (!stack.empty()) {
+        auto [node, indent] = stack.back();
+        stack.pop_back();
+        if (indent) {
+            os << std::setw(indent) << ' ';
+        }
+        if (node->right) {
+            os << " /\n" << std::setw(indent) << ' ';
+        }
+        node->print(os) << "\n ";
+        if (node->left) {
+            os << std::setw(indent) << ' ' << " \\\n";
+            pushRightSpine(node->left, indent + 4);
+        }
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::printTree(std::ostream &os) const {
+    RBTree::printTree(os, root);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto RBTree<T, EqualTo, Less, Allocator>::findInSubtree(node_ptr const &root,
+                                                        Key const &key)
+    -> node_ptr const * {
+    // Returns the link that owns the found node, so callers can share it
+    // without the descent itself copying any shared_ptr
+    auto link = &root;
+    while (*link) {
+        auto const &node = **link;
+        auto order = compareKeys(node.value, key);
+        if (order == 0) {
+            return link;
+        }
+        link = order < 0 ? &node.right : &node.left;
+    }
+    return nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto RBTree<T, EqualTo, Less, Allocator>::compareKeys(T const &value,
+                                                      Key const &key) {
+    tally(COMPARES);
+    return compareWith<EqualTo, Less>(value, key);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+void RBTree<T, EqualTo, Less, Allocator>::findBatch(
+    std::span<Key const> keys, std::span<T const *> out) const {
+    if (out.size() < keys.size()) {
+        throw BatchSizeMismatch("Error: batch output is shorter than input");
+    }
+#ifdef RBTREE_HASH_INDEX
+    if constexpr (IndexHashable<T, Key>) {
+        // Every slot of a batch is requested before the first one is read
+        std::array<uint64_t, batchWidth> hashes;
+        for (std::size_t first = 0; first < keys.size(); first += batchWidth) {
+            auto count = std::min(batchWidth, keys.size() - first);
+            for (std::size_t i = 0; i < count; ++i) {
+                hashes[i] = hashOf(keys[first + i]);
+                index.prefetch(hashes[i]);
+            }
+            for (std::size_t i = 0; i < count; ++i) {
+                auto const &key = keys[first + i];
+                auto node = index.find(hashes[i], [&key](Node const *node) {
+                    tally(COMPARES);
+                    return EqualTo()(node->value, key);
+                });
+                out[first + i] = node ? &node->value : nullptr;
+            }
+        }
+        return;
+    }
+#endif
+    for (std::size_t first = 0; first < keys.size(); first += batchWidth) {
+        auto count = std::min(batchWidth, keys.size() - first);
+        std::array<Node const *, batchWidth> cursors;
+        for (std::size_t i = 0; i < count; ++i) {
+            cursors[i] = root;
+            out[first + i] = nullptr;
+        }
+        // One step of every unfinished descent per round; by the time a
+        // descent gets its next turn, its node is usually in cache
+        for (auto active = count; active > 0;) {
+            active = 0;
+            for (std::size_t i = 0; i < count; ++i) {
+                auto node = cursors[i];
+                if (!node) {
+                    continue;
+                }
+                auto order = compareKeys(node->value, keys[first + i]);
+                if (order == 0) {
+                    out[first + i] = &node->value;
+                    cursors[i] = nullptr;
+                    continue;
+                }
+                node = order < 0 ? node->right : node->left;
+                prefetch(node);
+                cursors[i] = node;
+                active += node != nullptr;
+            }
+        }
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::prefetch(Node const *node) {
+#if defined(__GNUC__) || defined(__clang__)
+    if (node) {
+        __builtin_prefetch(node);
+    }
+#else
+    (void)node;
+#endif
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::subtreesEqual(node_ptr const &r1,
+                                                        node_ptr const &r2) {
+    std::vector<std::pair<Node const *, Node const *>> stack;
+    stack.emplace_back(r1, r2);
+    while (!stack.empty()) {
+        auto [n1, n2] = stack.back();
+        stack.pop_back();
+        if (static_cast<bool>(n1) != static_cast<bool>(n2)) {
+            return false;
+        } else if (n1) {
+            if (!(*n1 == *n2)) {
+                return false;
+            }
+            stack.emplace_back(n1->right, n2->right);
+            stack.emplace_back(n1->left, n2->left);
+        }
+    }
+    return true;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::begin() const -> const_iterator {
+    return const_iterator(const_iterator::leftmost(root), root);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::end() const -> const_iterator {
+    return const_iterator(nullptr, root);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::cbegin() const -> const_iterator {
+    return begin();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::cend() const -> const_iterator {
+    return end();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::lower_bound(T const &value) const
+    -> const_iterator {
+    return boundOf(value, false);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::upper_bound(T const &value) const
+    -> const_iterator {
+    return boundOf(value, true);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::equal_range(T const &value) const
+    -> std::pair<const_iterator, const_iterator> {
+    return {boundOf(value, false), boundOf(value, true)};
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto RBTree<T, EqualTo, Less, Allocator>::lower_bound(Key const &key) const
+    -> const_iterator {
+    return boundOf(key, false);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto RBTree<T, EqualTo, Less, Allocator>::upper_bound(Key const &key) const
+    -> const_iterator {
+    return boundOf(key, true);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto RBTree<T, EqualTo, Less, Allocator>::equal_range(Key const &key) const
+    -> std::pair<const_iterator, const_iterator> {
+    return {boundOf(key, false), boundOf(key, true)};
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Callback>
+void RBTree<T, EqualTo, Less, Allocator>::scan(T const &from, T const &to,
+                                               Callback &&callback) const {
+    scanRange(from, to, callback);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key, typename Callback>
+    requires Transparent<EqualTo> && Transparent<Less>
+void RBTree<T, EqualTo, Less, Allocator>::scan(Key const &from, Key const &to,
+                                               Callback &&callback) const {
+    scanRange(from, to, callback);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto RBTree<T, EqualTo, Less, Allocator>::boundOf(Key const &key,
+                                                  bool inclusive) const
+    -> const_iterator {
+    // The answer is the last node where the descent turned left
+    Node const *bound = nullptr;
+    auto node = root;
+    while (node) {
+        auto order = compareKeys(node->value, key);
+        if (order < 0 || (inclusive && order == 0)) {
+            node = node->right;
+        } else {
+            bound = node;
+            node = node->left;
+        }
+    }
+    return const_iterator(bound, root);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key, typename Callback>
+void RBTree<T, EqualTo, Less, Allocator>::scanRange(Key const &from,
+                                                    Key const &to,
+                                                    Callback &callback) const {
+    for (auto it = boundOf(from, false); it != end(); ++it) {
+        if (compareKeys(*it, to) > 0) {
+            break;
+        }
+        using Result = std::invoke_result_t<Callback &, T const &>;
+        if constexpr (std::is_same_v<Result, bool>) {
+            if (!callback(*it)) {
+                break;
+            }
+        } else {
+            callback(*it);
+        }
+    }
+}
+
+#ifdef RBTREE_ORDER_STATISTICS
+template <class T, typename EqualTo, typename Less, typename Allocator>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::rank(T const &value) const {
+    return countBelow(value, false);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::select(uint64_t index) const
+    -> T const & {
+    if (index >= _size) {
+        throw NoSuchElement("Error: no element with given index in RBTree!");
+    }
+    auto node = root;
+    while (true) {
+        auto leftSize = subtreeSize(node->left);
+        if (index < leftSize) {
+            node = node->left;
+        } else if (index == leftSize) {
+            return node->value;
+        } else {
+            index -= leftSize + 1;
+            node = node->right;
+        }
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::countRange(T const &low,
+                                                         T const &high) const {
+    auto upToHigh = countBelow(high, true);
+    auto belowLow = countBelow(low, false);
+    return upToHigh > belowLow ? upToHigh - belowLow : 0;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::rank(Key const &key) const {
+    return countBelow(key, false);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::countRange(
+    Key const &low, Key const &high) const {
+    auto upToHigh = countBelow(high, true);
+    auto belowLow = countBelow(low, false);
+    return upToHigh > belowLow ? upToHigh - belowLow : 0;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::countBelow(Key const &key,
+                                                         bool inclusive) const {
+    // Every step to the right skips the left subtree and the node itself
+    uint64_t count = 0;
+    auto node = root;
+    while (node) {
+        auto order = compareKeys(node->value, key);
+        if (order < 0 || (inclusive && order == 0)) {
+            count += subtreeSize(node->left) + 1;
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    return count;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+uint64_t
+RBTree<T, EqualTo, Less, Allocator>::subtreeSize(node_ptr const &node) {
+    return node ? node->subtreeSize : 0;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::updateSubtreeSize(
+    node_ptr const &node) {
+    node->subtreeSize = 1 + subtreeSize(node->left) + subtreeSize(node->right);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::recountSubtreeSizes(
+    node_ptr const &root) {
+    // Reversed pre-order visits children before their parents
+    std::vector<node_ptr const *> order;
+    std::vector<node_ptr const *> stack;
+    if (root) {
+        stack.push_back(&root);
+    }
+    while (!stack.empty()) {
+        auto link = stack.back();
+        stack.pop_back();
+        order.push_back(link);
+        if ((*link)->left) {
+            stack.push_back(&(*link)->left);
+        }
+        if ((*link)->right) {
+            stack.push_back(&(*link)->right);
+        }
+    }
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        updateSubtreeSize(**it);
+    }
+}
+#endif
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::tally(
+    [[maybe_unused]] Counter counter, [[maybe_unused]] uint64_t times) {
+#ifdef RBTREE_STATS
+    counters[counter].fetch_add(times, std::memory_order_relaxed);
+#endif
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto RBTree<T, EqualTo, Less, Allocator>::lookup(Key const &key) const
+    -> T const * {
+#ifdef RBTREE_HASH_INDEX
+    if constexpr (IndexHashable<T, Key>) {
+        auto node = index.find(hashOf(key), [&key](Node const *node) {
+            tally(COMPARES);
+            return EqualTo()(node->value, key);
+        });
+        return node ? &node->value : nullptr;
+    }
+#endif
+    auto link = findInSubtree(root, key);
+    return link ? &(*link)->value : nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::hashOf(Key const &key) {
+    return static_cast<uint64_t>(IndexHash<T>()(key));
+}
+
+// The index hooks are empty unless RBTREE_HASH_INDEX is defined and T can
+// be hashed
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::indexNode(
+    [[maybe_unused]] node_ptr node) {
+#ifdef RBTREE_HASH_INDEX
+    if constexpr (IndexHashable<T>) {
+        index.insert(hashOf(node->value), node);
+    }
+#endif
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::unindexNode(
+    [[maybe_unused]] node_ptr node) {
+#ifdef RBTREE_HASH_INDEX
+    if constexpr (IndexHashable<T>) {
+        index.erase(hashOf(node->value), node);
+    }
+#endif
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::rebuildIndex() {
+#ifdef RBTREE_HASH_INDEX
+    if constexpr (IndexHashable<T>) {
+        index.clear();
+        index.reserve(_size);
+        std::vector<node_ptr> stack;
+        if (root) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            indexNode(node);
+            for (auto child : {node->left, node->right}) {
+                if (child) {
+                    stack.push_back(child);
+                }
+            }
+        }
+    }
+#endif
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::makeNode(Color color, T value)
+    -> node_ptr {
+    tally(ALLOCATIONS);
+    NodeAllocator nodeAlloc(alloc);
+    auto node = NodeTraits::allocate(nodeAlloc, 1);
+    try {
+        NodeTraits::construct(nodeAlloc, node, color, std::move(value));
+    } catch (...) {
+        NodeTraits::deallocate(nodeAlloc, node, 1);
+        throw;
+    }
+    return node;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::destroyNode(node_ptr node) {
+    if (!node) {
+        return;
+    }
+    NodeAllocator nodeAlloc(alloc);
+    NodeTraits::destroy(nodeAlloc, node);
+    if (!inBlock(node)) {
+        NodeTraits::deallocate(nodeAlloc, node, 1);
+    }
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::printTree(std::ostream &os, node_ptr root,
-                                         int indent) {
-    if (root != NULL) {
-        if (root->right) {
-            printTree(os, root->right, indent + 4);
-        }
-        if (indent) {
-            os << std::setw(indent) << ' ';
-        }
-        if (root->right) {
-            os << " /\n" << std::setw(indent) << ' ';
-        }
-        root->print(os) << "\n ";
-        if (root->left) {
-            os << std::setw(indent) << ' ' << " \\\n";
-            printTree(os, root->left, indent + 4);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::destroySubtree(node_ptr node) {
+    // Rotates every left child up until the node has none, then frees it
+    // and goes right; needs neither recursion nor a stack
+    while (node) {
+        if (node->left) {
+            auto left = node->left;
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        } else {
+            auto right = node->right;
+            destroyNode(node);
+            node = right;
         }
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::printTree(std::ostream &os) const {
-    RBTree<T, EqualTo, Less>::printTree(os, root);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::inBlock(node_ptr node) const {
+    std::less<Node const *> less;
+    return std::ranges::any_of(blocks, [&](Block const &block) {
+        auto nodes = block.nodes.get();
+        return !less(node, nodes) && less(node, nodes + block.size);
+    });
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::findInSubtree(node_ptr root, T const &value)
-    -> node_ptr {
-    node_ptr result = nullptr;
-    if (!root) {
-        throw NoSuchElementInSubtree("Error: no such element in subtree");
-    } else if (EqualTo()(*root->value, value)) {
-        result = root;
-    } else if (Less()(*root->value, value)) {
-        result = findInSubtree(root->right, value);
-    } else {
-        result = findInSubtree(root->left, value);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::adoptBlocks(RBTree &other) {
+    for (auto &block : other.blocks) {
+        if (std::ranges::none_of(blocks, [&](Block const &own) {
+                return own.nodes == block.nodes;
+            })) {
+            blocks.push_back(std::move(block));
+        }
     }
-    return result;
+    other.blocks.clear();
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::subtreesEqual(node_ptr r1, node_ptr r2) {
-    if (static_cast<bool>(r1) != static_cast<bool>(r2)) {
-        return false;
-    } else {
-        return !(r1 || r2) ||
-               ((*r1 == *r2) && subtreesEqual(r1->left, r2->left) &&
-                subtreesEqual(r1->right, r2->right));
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::release(node_ptr node)
+    -> value_ptr {
+    // The node goes back to the allocator and its value into the handle
+    try {
+        auto value = std::make_shared<T>(std::move(node->value));
+        destroyNode(node);
+        return value;
+    } catch (...) {
+        destroyNode(node);
+        throw;
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::leftRotate(node_ptr node) -> node_ptr {
-    auto parent = node->parent.lock();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::leftRotate(node_ptr node)
+    -> node_ptr {
+    tally(ROTATIONS);
+    auto parent = node->parent();
 
     // Set names
     auto root = node;
@@ -314,12 +1620,12 @@ auto RBTree<T, EqualTo, Less>::leftRotate(node_ptr node) -> node_ptr {
     // Set link between root and midSubTree
     root->right = midSubTree;
     if (midSubTree) {
-        midSubTree->parent = root;
+        midSubTree->setParent(root);
     }
 
     // Set link between root and pivot
     pivot->left = root;
-    root->parent = pivot;
+    root->setParent(pivot);
 
     // Set link between pivot and parent
     if (parent) {
@@ -329,14 +1635,20 @@ auto RBTree<T, EqualTo, Less>::leftRotate(node_ptr node) -> node_ptr {
             parent->right = pivot;
         }
     }
-    pivot->parent = parent;
+    pivot->setParent(parent);
 
+#ifdef RBTREE_ORDER_STATISTICS
+    pivot->subtreeSize = root->subtreeSize;
+    updateSubtreeSize(root);
+#endif
     return pivot;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::rightRotate(node_ptr node) -> node_ptr {
-    auto parent = node->parent.lock();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::rightRotate(node_ptr node)
+    -> node_ptr {
+    tally(ROTATIONS);
+    auto parent = node->parent();
 
     // Set names
     auto root = node;
@@ -349,12 +1661,12 @@ auto RBTree<T, EqualTo, Less>::rightRotate(node_ptr node) -> node_ptr {
     // Set link between root and midSubTree
     root->left = midSubTree;
     if (midSubTree) {
-        midSubTree->parent = root;
+        midSubTree->setParent(root);
     }
 
     // Set link between root and pivot
     pivot->right = root;
-    root->parent = pivot;
+    root->setParent(pivot);
 
     // Set link between pivot and parent
     if (parent) {
@@ -364,12 +1676,17 @@ auto RBTree<T, EqualTo, Less>::rightRotate(node_ptr node) -> node_ptr {
             parent->right = pivot;
         }
     }
-    pivot->parent = parent;
+    pivot->setParent(parent);
+
+#ifdef RBTREE_ORDER_STATISTICS
+    pivot->subtreeSize = root->subtreeSize;
+    updateSubtreeSize(root);
+#endif
     return pivot;
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::saveToBinary(std::ostream &os) const
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::saveToBinary(std::ostream &os) const
     requires Serializable<T>
 {
     uint64_t size = _size;
@@ -377,46 +1694,148 @@ void RBTree<T, EqualTo, Less>::saveToBinary(std::ostream &os) const
     saveToBinarySubtree(os, root);
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::saveToBinarySubtree(std::ostream &os,
-                                                   node_ptr node) {
-    bool exists = node != nullptr;
-    os.write(reinterpret_cast<const char *>(&exists), sizeof(exists));
-    if (exists) {
-        node->serialize(os);
-        saveToBinarySubtree(os, node->left);
-        saveToBinarySubtree(os, node->right);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::saveToBinarySubtree(
+    std::ostream &os, node_ptr const &node) {
+    // Pre-order with a marker for every missing child
+    std::vector<Node const *> stack{node};
+    while (!stack.empty()) {
+        auto current = stack.back();
+        stack.pop_back();
+        bool exists = current != nullptr;
+        os.write(reinterpret_cast<const char *>(&exists), sizeof(exists));
+        if (exists) {
+            current->serialize(os);
+            stack.push_back(current->right);
+            stack.push_back(current->left);
+        }
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::readFromBinary(std::istream &is) -> RBTree
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::readFromBinary(
+    std::istream &is, Allocator const &alloc) -> RBTree
     requires Serializable<T>
 {
-    RBTree<T, EqualTo, Less> tree;
+    RBTree tree(alloc);
     is.read(reinterpret_cast<char *>(&tree._size), sizeof(tree._size));
-    tree.root = readSubtreeFromBinary(is);
+    tree.readSubtreeFromBinary(is);
+#ifdef RBTREE_ORDER_STATISTICS
+    recountSubtreeSizes(tree.root);
+#endif
+    tree.rebuildIndex();
     return tree;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::readSubtreeFromBinary(std::istream &is)
-    -> node_ptr {
-    bool exists;
-    is.read(reinterpret_cast<char *>(&exists), sizeof(exists));
-    if (!exists) {
-        return nullptr;
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::readSubtreeFromBinary(
+    std::istream &is) {
+    // Every entry is an empty link waiting to be filled and its parent.
+    // Nodes are linked in as soon as they exist, so the tree frees them if
+    // reading fails halfway.
+    std::vector<std::pair<node_ptr *, node_ptr const *>> stack;
+    stack.emplace_back(&root, nullptr);
+    while (!stack.empty()) {
+        auto [link, parent] = stack.back();
+        stack.pop_back();
+        bool exists;
+        is.read(reinterpret_cast<char *>(&exists), sizeof(exists));
+        if (!exists) {
+            continue;
+        }
+        char color;
+        is.read(&color, sizeof(color));
+        auto &node = *link =
+            makeNode(static_cast<Color>(color), T::deserialize(is));
+        if (parent) {
+            node->setParent(*parent);
+        }
+        stack.emplace_back(&node->right, link);
+        stack.emplace_back(&node->left, link);
     }
-    auto node = Node::deserialize(is);
-    node->left = readSubtreeFromBinary(is);
-    if (node->left) {
-        node->left->parent = node;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::saveToFlatBinary(
+    std::ostream &os) const
+    requires FlatSerializable<T>
+{
+    using FlatEntry = FlatSnapshotEntry<typename T::FlatRecord>;
+    std::vector<FlatEntry> entries;
+    entries.reserve(_size);
+    std::string blob;
+    std::vector<Node const *> stack;
+    if (root) {
+        stack.push_back(root);
     }
-    node->right = readSubtreeFromBinary(is);
-    if (node->right) {
-        node->right->parent = node;
+    while (!stack.empty()) {
+        auto node = stack.back();
+        stack.pop_back();
+        FlatEntry entry;
+        // Padding is part of the checksum, so it has to be deterministic
+        std::memset(&entry, 0, sizeof(entry));
+        entry.record = node->value.toFlat(blob);
+        entry.color = static_cast<uint8_t>(node->color());
+        entry.children = static_cast<uint8_t>(
+            (node->left ? FlatEntry::HAS_LEFT : 0) |
+            (node->right ? FlatEntry::HAS_RIGHT : 0));
+        entries.push_back(entry);
+        if (node->right) {
+            stack.push_back(node->right);
+        }
+        if (node->left) {
+            stack.push_back(node->left);
+        }
     }
-    return node;
+    writeFlatSnapshot(os,
+                      std::span<char const>(
+                          reinterpret_cast<char const *>(entries.data()),
+                          entries.size() * sizeof(FlatEntry)),
+                      sizeof(FlatEntry), entries.size(), blob);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::readFromFlatBinary(
+    std::span<char const> image, Allocator const &alloc) -> RBTree
+    requires FlatSerializable<T>
+{
+    using FlatEntry = FlatSnapshotEntry<typename T::FlatRecord>;
+    auto [count, records, blob] = openFlatSnapshot(image, sizeof(FlatEntry));
+
+    // Same shape rebuilding as readSubtreeFromBinary, driven by the flags
+    RBTree tree(alloc);
+    std::vector<std::pair<node_ptr *, node_ptr const *>> stack;
+    stack.emplace_back(&tree.root, nullptr);
+    for (std::size_t i = 0; i < count; ++i) {
+        FlatEntry entry;
+        std::memcpy(&entry, records.data() + i * sizeof(FlatEntry),
+                    sizeof(FlatEntry));
+        if (stack.empty() || entry.color > RED) {
+            throw SnapshotCorrupted("Error: snapshot has invalid structure");
+        }
+        auto [link, parent] = stack.back();
+        stack.pop_back();
+        auto &node = *link = tree.makeNode(static_cast<Color>(entry.color),
+                                           T::fromFlat(entry.record, blob));
+        if (parent) {
+            node->setParent(*parent);
+        }
+        if (entry.children & FlatEntry::HAS_RIGHT) {
+            stack.emplace_back(&node->right, link);
+        }
+        if (entry.children & FlatEntry::HAS_LEFT) {
+            stack.emplace_back(&node->left, link);
+        }
+    }
+    if (!stack.empty() && count > 0) {
+        throw SnapshotCorrupted("Error: snapshot has invalid structure");
+    }
+    tree._size = count;
+#ifdef RBTREE_ORDER_STATISTICS
+    recountSubtreeSizes(tree.root);
+#endif
+    tree.rebuildIndex();
+    return tree;
 }
 
 #endif
@@ -426,51 +1845,166 @@ auto RBTree<T, EqualTo, Less>::readSubtreeFromBinary(std::istream &is)
 // Node class methods implementation
 #ifdef RB_TREE_HPP
 #define RB_TREE_HPP
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::Node::leftIsTheOne(node_ptr node,
-                                                  T const &value) {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::Node::leftIsTheOne(node_ptr node,
+                                                             T const &value) {
     return (node != nullptr) && (node->left != nullptr) &&
-           EqualTo()(*node->left->value, value);
+           EqualTo()(node->left->value, value);
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::Node::rightIsTheOne(node_ptr node,
-                                                   T const &value) {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::Node::rightIsTheOne(node_ptr node,
+                                                              T const &value) {
     return (node != nullptr) && (node->right != nullptr) &&
-           EqualTo()(*node->right->value, value);
+           EqualTo()(node->right->value, value);
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::Node::operator==(Node const &other) const {
-    return (this->color == other.color) &&
-           EqualTo()(*this->value, *other.value);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::Node::operator==(
+    Node const &other) const {
+    tally(COMPARES);
+    return (this->color() == other.color()) &&
+           EqualTo()(this->value, other.value);
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::Node::hasNoKids() const {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::Node::hasNoKids() const {
     return (left == nullptr) && (right == nullptr);
 }
 
-template <class T, typename EqualTo, typename Less>
-std::ostream &RBTree<T, EqualTo, Less>::Node::print(std::ostream &os) const {
-    return os << "(" << *value << ", " << static_cast<int>(color) << ")";
+template <class T, typename EqualTo, typename Less, typename Allocator>
+std::ostream &
+RBTree<T, EqualTo, Less, Allocator>::Node::print(std::ostream &os) const {
+    return os << "(" << value << ", " << static_cast<int>(color()) << ")";
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::Node::serialize(std::ostream &os) const {
-    char color = static_cast<char>(this->color);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::Node::serialize(
+    std::ostream &os) const {
+    char color = static_cast<char>(this->color());
     os.write(&color, sizeof(color));
-    value->serialize(os);
+    value.serialize(os);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::Node::parent() const -> Node * {
+    return reinterpret_cast<Node *>(parentAndColor & ~colorBit);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::Node::setParent(Node *parent) {
+    parentAndColor =
+        reinterpret_cast<std::uintptr_t>(parent) | (parentAndColor & colorBit);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::Node::color() const -> Color {
+    return static_cast<Color>(parentAndColor & colorBit);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::Node::setColor(Color color) {
+    parentAndColor =
+        (parentAndColor & ~colorBit) | static_cast<std::uintptr_t>(color);
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+// const_iterator class methods implementation
+#ifdef RB_TREE_HPP
+#define RB_TREE_HPP
+template <class T, typename EqualTo, typename Less, typename Allocator>
+RBTree<T, EqualTo, Less, Allocator>::const_iterator::const_iterator(
+    Node const *node, Node const *root)
+    : node(node), root(root) {}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::const_iterator::operator*() const
+    -> reference {
+    return node->value;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::const_iterator::operator->() const
+    -> pointer {
+    return &node->value;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::const_iterator::operator++()
+    -> const_iterator & {
+    if (node->right) {
+        node = leftmost(node->right);
+        return *this;
+    }
+    // Climb until the node we leave is a left child
+    Node const *child;
+    do {
+        child = node;
+        node = node->parent();
+    } while (node && node->right == child);
+    return *this;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::const_iterator::operator++(int)
+    -> const_iterator {
+    auto old = *this;
+    ++*this;
+    return old;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::const_iterator::operator--()
+    -> const_iterator & {
+    if (!node) {
+        node = rightmost(root);
+        return *this;
+    }
+    if (node->left) {
+        node = rightmost(node->left);
+        return *this;
+    }
+    Node const *child;
+    do {
+        child = node;
+        node = node->parent();
+    } while (node && node->left == child);
+    return *this;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::const_iterator::operator--(int)
+    -> const_iterator {
+    auto old = *this;
+    --*this;
+    return old;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::const_iterator::operator==(
+    const_iterator const &other) const {
+    return node == other.node;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::const_iterator::leftmost(
+    Node const *node) -> Node const * {
+    while (node && node->left) {
+        node = node->left;
+    }
+    return node;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::Node::deserialize(std::istream &is) -> node_ptr {
-    char color;
-    is.read(reinterpret_cast<char *>(&color), sizeof(color));
-    Color node_color = static_cast<Color>(color);
-    T val = T::deserialize(is);
-    auto value_ptr = std::make_shared<T>(val);
-    return std::make_shared<Node>(node_color, value_ptr);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::const_iterator::rightmost(
+    Node const *node) -> Node const * {
+    while (node && node->right) {
+        node = node->right;
+    }
+    return node;
 }
 
 #endif
@@ -480,58 +2014,55 @@ auto RBTree<T, EqualTo, Less>::Node::deserialize(std::istream &is) -> node_ptr {
 // AdditionMethodImplementation class methods implementation
 #ifdef RB_TREE_HPP
 #define RB_TREE_HPP
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::AdditionMethodImplementation::run(
-    T const &value) {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key, typename Make>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::run(
+    Key const &key, Make &&make) -> std::pair<node_ptr, bool> {
     if (tree->empty()) {
-        tree->root = makeNode(BLACK, value);
-    } else {
-        auto node = addToLeafOfSubtree(tree->root, value);
-        balanceFrom(node);
+        tree->root = tree->makeNode(BLACK, make());
+        tree->indexNode(tree->root);
+        ++tree->_size;
+        return {tree->root, true};
+    }
+    auto position = findLeafParentInSubtree(tree->root, key);
+    if (position.found) {
+        return {position.node, false};
     }
+    auto node = addNodeToLeaf(position.node, position.side, make());
+#ifdef RBTREE_ORDER_STATISTICS
+    for (auto parent = node->parent(); parent; parent = parent->parent()) {
+        ++parent->subtreeSize;
+    }
+#endif
+    tree->indexNode(node);
+    // Rotations move nodes around but never free one
+    balanceFrom(node);
     ++tree->_size;
+    return {node, true};
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::
-    findLeafParentInSubtree(node_ptr root, T const &value) -> node_ptr {
-    node_ptr result = nullptr;
-    if (!root) {
-        throw TreeEmpty("Error: empty tree");
-    } else if (EqualTo()(*root->value, value)) {
-        throw NoLeafParentElementInTree("Error: no leaf parent in subtree");
-    } else if (Less()(*root->value, value)) {
-        if (!root->right) {
-            result = root;
-        } else {
-            result = findLeafParentInSubtree(root->right, value);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    findLeafParentInSubtree(node_ptr root, Key const &key) -> Position {
+    auto node = root;
+    while (true) {
+        auto order = compareKeys(node->value, key);
+        if (order == 0) {
+            return {node, true, LEFT};
         }
-    } else {
-        if (!root->left) {
-            result = root;
-        } else {
-            result = findLeafParentInSubtree(root->left, value);
+        auto side = order < 0 ? RIGHT : LEFT;
+        auto next = side == RIGHT ? node->right : node->left;
+        if (!next) {
+            return {node, false, side};
         }
-    }
-    return result;
-}
-
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::addToLeafOfSubtree(
-    node_ptr root, T const &value) -> node_ptr {
-    try {
-        node_ptr node = findLeafParentInSubtree(root, value);
-        return addNodeToLeaf(node, value);
-    } catch (TreeEmpty const &e) {
-        throw e;
-    } catch (...) {
-        throw TreeHasGivenElement("Error: tree has element with given value");
+        node = next;
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::AdditionMethodImplementation::balanceFrom(
-    node_ptr node) {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    balanceFrom(node_ptr node) {
     while (redNode(node) && redParent(node)) {
         if (redUncleCase(node)) {
             node = recolorParentAndUncleAndGrandfather(node);
@@ -544,69 +2075,69 @@ void RBTree<T, EqualTo, Less>::AdditionMethodImplementation::balanceFrom(
     restoreRootProperty();
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::AdditionMethodImplementation::redNode(
-    node_ptr node) {
-    return (node) && (node->color == RED);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    redNode(node_ptr node) {
+    return (node) && (node->color() == RED);
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::AdditionMethodImplementation::redParent(
-    node_ptr node) {
-    auto parent = node->parent.lock();
-    return (parent) && (parent->color == Color::RED);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    redParent(node_ptr node) {
+    auto parent = node->parent();
+    return (parent) && (parent->color() == Color::RED);
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::AdditionMethodImplementation::noGrandFatherCase(
-    node_ptr node) {
-    auto parent = node->parent.lock();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    noGrandFatherCase(node_ptr node) {
+    auto parent = node->parent();
     if (!parent)
         return true;
-    return !parent->parent.lock();
+    return !parent->parent();
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::AdditionMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
     leftChildParentCase(node_ptr node) {
-    auto parent = node->parent.lock();
+    auto parent = node->parent();
     if (!parent)
         return false;
-    auto grandparent = parent->parent.lock();
+    auto grandparent = parent->parent();
     if (!grandparent)
         return false;
     return grandparent->left == parent;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
     leftChildParentCaseBalance(node_ptr node) -> node_ptr {
     if (rightChildNodeCase(node)) {
-        node = node->parent.lock();
+        node = node->parent();
         node = tree->leftRotate(node)->left;
     }
     auto grandfather = recolorParentAndGrandfather(node);
     return tree->rightRotate(grandfather);
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
     rightChildParentCaseBalance(node_ptr node) -> node_ptr {
     if (leftChildNodeCase(node)) {
-        node = node->parent.lock();
+        node = node->parent();
         node = tree->rightRotate(node)->right;
     }
     auto grandfather = recolorParentAndGrandfather(node);
     return tree->leftRotate(grandfather);
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::AdditionMethodImplementation::redUncleCase(
-    node_ptr node) {
-    auto parent = node->parent.lock();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    redUncleCase(node_ptr node) {
+    auto parent = node->parent();
     if (!parent)
         return false;
-    auto grandfather = parent->parent.lock();
+    auto grandfather = parent->parent();
     if (!grandfather)
         return false;
     node_ptr uncle;
@@ -615,98 +2146,94 @@ bool RBTree<T, EqualTo, Less>::AdditionMethodImplementation::redUncleCase(
     } else {
         uncle = grandfather->left;
     }
-    return (uncle) && (uncle->color == RED);
+    return (uncle) && (uncle->color() == RED);
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
     recolorParentAndGrandfather(node_ptr node) -> node_ptr {
-    auto parent = node->parent.lock();
-    auto grandfather = parent->parent.lock();
-    parent->color = BLACK;
-    grandfather->color = RED;
+    auto parent = node->parent();
+    auto grandfather = parent->parent();
+    parent->setColor(BLACK);
+    grandfather->setColor(RED);
+    tally(RECOLORS, 2);
     return grandfather;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
     recolorParentAndUncleAndGrandfather(node_ptr node) -> node_ptr {
-    auto parent = node->parent.lock();
-    auto grandfather = parent->parent.lock();
+    auto parent = node->parent();
+    auto grandfather = parent->parent();
     node_ptr uncle;
     if (parent == grandfather->right) {
         uncle = grandfather->left;
     } else {
         uncle = grandfather->right;
     }
-    parent->color = uncle->color = BLACK;
-    grandfather->color = RED;
+    parent->setColor(BLACK);
+    uncle->setColor(BLACK);
+    grandfather->setColor(RED);
+    tally(RECOLORS, 3);
     return grandfather;
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::AdditionMethodImplementation::rightChildNodeCase(
-    node_ptr node) {
-    auto parent = node->parent.lock();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    rightChildNodeCase(node_ptr node) {
+    auto parent = node->parent();
     return (parent) && (parent->right == node);
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::AdditionMethodImplementation::leftChildNodeCase(
-    node_ptr node) {
-    auto parent = node->parent.lock();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    leftChildNodeCase(node_ptr node) {
+    auto parent = node->parent();
     return (parent) && (parent->left == node);
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo,
-            Less>::AdditionMethodImplementation::restoreRootProperty() {
-    tree->root->color = BLACK;
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less,
+            Allocator>::AdditionMethodImplementation::restoreRootProperty() {
+    if (tree->root->color() == RED) {
+        tally(RECOLORS);
+    }
+    tree->root->setColor(BLACK);
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::addNodeToLeaf(
-    node_ptr node, T const &value) -> node_ptr {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    addNodeToLeaf(node_ptr node, ChildSide side, T &&value) -> node_ptr {
     node_ptr leaf;
-    if (EqualTo()(*node->value, value)) {
-        throw TreeHasGivenElement(
-            "Error: can not add repeating element to leaf!");
-    } else if (Less()(*node->value, value)) {
-        leaf = addNodeToRightLeaf(node, value);
+    if (side == RIGHT) {
+        leaf = addNodeToRightLeaf(node, std::move(value));
     } else {
-        leaf = addNodeToLeftLeaf(node, value);
+        leaf = addNodeToLeftLeaf(node, std::move(value));
     }
-    leaf->parent = node;
+    leaf->setParent(node);
     return leaf;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::addNodeToLeftLeaf(
-    node_ptr node, T const &value) -> node_ptr {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    addNodeToLeftLeaf(node_ptr node, T &&value) -> node_ptr {
     if (!node->left) {
-        return node->left = makeNode(Color::RED, value);
+        return node->left = tree->makeNode(Color::RED, std::move(value));
     } else {
         throw TreeHasGivenElement("Error: can not add leaf to node!");
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::addNodeToRightLeaf(
-    node_ptr node, T const &value) -> node_ptr {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::AdditionMethodImplementation::
+    addNodeToRightLeaf(node_ptr node, T &&value) -> node_ptr {
     if (!node->right) {
-        return node->right = makeNode(Color::RED, value);
+        return node->right = tree->makeNode(Color::RED, std::move(value));
     } else {
         throw TreeHasGivenElement("Error: can not add leaf to node!");
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::makeNode(
-    Color color, T const &value) -> node_ptr {
-    auto v_ptr = std::make_shared<T>(value);
-    return std::make_shared<Node>(color, v_ptr);
-}
-
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -715,34 +2242,39 @@ auto RBTree<T, EqualTo, Less>::AdditionMethodImplementation::makeNode(
 #ifdef RB_TREE_HPP
 #define RB_TREE_HPP
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::RemovalMethodImplementation::run(T const &value)
-    -> value_ptr {
-    if (tree->empty()) {
-        throw TreeEmpty("Error: can not remove node from empty RBTree!");
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::run(
+    Key const &key) -> node_ptr {
+    auto link = tree->findInSubtree(tree->root, key);
+    if (!link) {
+        return nullptr;
     }
-    try {
-        auto node = tree->findInSubtree(tree->root, value);
-        auto value = node->value;
-        node = removeNode(node);
-        auto parent = node->parent.lock();
-        if (!parent) {
-            node->color = BLACK;
-        } else if (node->color == BLACK) {
-            auto side = (Less()(*node->value, *parent->value) ? LEFT : RIGHT);
-            fixBlackHeight(parent, side);
-            tree->root->color = BLACK;
-        }
-        --tree->_size;
-        return value;
-    } catch (NoSuchElementInSubtree const &e) {
-        throw NoSuchElement(e.what());
+    auto node = removeNode(*link);
+    auto parent = node->parent();
+#ifdef RBTREE_ORDER_STATISTICS
+    // Sizes have to be right before the fix-up starts rotating
+    for (auto ancestor = parent; ancestor; ancestor = ancestor->parent()) {
+        --ancestor->subtreeSize;
+    }
+#endif
+    if (!parent) {
+        node->setColor(BLACK);
+    } else if (node->color() == BLACK) {
+        fixBlackHeight(parent, removedSide);
+        tree->root->setColor(BLACK);
     }
+    --tree->_size;
+    tree->unindexNode(node);
+    // The caller may keep the node alive, but not the rest of the tree
+    node->left = node->right = nullptr;
+    node->setParent(nullptr);
+    return node;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::RemovalMethodImplementation::removeNode(
-    node_ptr node) -> node_ptr {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
+    removeNode(node_ptr node) -> node_ptr {
     if (childlessNodeCase(node)) {
         node = removeChildlessNode(node);
     } else if (nodeWithOneChildCase(node)) {
@@ -753,64 +2285,112 @@ auto RBTree<T, EqualTo, Less>::RemovalMethodImplementation::removeNode(
     return node;
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::RemovalMethodImplementation::childlessNodeCase(
-    node_ptr node) {
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
+    childlessNodeCase(node_ptr node) {
     return !(node->left || node->right);
 }
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
     nodeWithOneChildCase(node_ptr node) {
     return (node->left && !node->right) || (!node->left && node->right);
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::RemovalMethodImplementation::removeChildlessNode(
-    node_ptr node) -> node_ptr {
-    auto parent = node->parent.lock();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
+    removeChildlessNode(node_ptr node) -> node_ptr {
+    auto parent = node->parent();
     if (!parent) {
         tree->root = nullptr;
     } else if (node == parent->left) {
         parent->left = nullptr;
+        removedSide = LEFT;
     } else {
         parent->right = nullptr;
+        removedSide = RIGHT;
     }
     return node;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
     removeNodeWithOneChild(node_ptr node) -> node_ptr {
-    auto parent = node->parent.lock();
+    auto parent = node->parent();
     auto child = (node->left ? node->left : node->right);
     if (!parent) {
         tree->root = child;
-        child->parent = wnode_ptr();
-        tree->root->color = BLACK;
+        child->setParent(nullptr);
+        tree->root->setColor(BLACK);
     } else if (node == parent->left) {
         parent->left = child;
-        child->parent = parent;
+        child->setParent(parent);
+        removedSide = LEFT;
     } else {
         parent->right = child;
-        child->parent = parent;
+        child->setParent(parent);
+        removedSide = RIGHT;
     }
     return node;
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
     removeNodeWithTwoChildren(node_ptr node) -> node_ptr {
     auto next = findLeastLargestNodeFromNodeWithTwoChildren(node);
-    node->value = next->value;
-    if (next->right) {
-        return removeNodeWithOneChild(next);
+    swapWithLeastLargestNode(node, next);
+    if (node->right) {
+        return removeNodeWithOneChild(node);
+    } else {
+        return removeChildlessNode(node);
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
+    swapWithLeastLargestNode(node_ptr node, node_ptr next) {
+    // Nodes trade places instead of values, so pointers to the value of next
+    // and its index entry stay valid after its node takes over the position
+    // of the removed one
+    auto parent = node->parent();
+    auto nextParent = next->parent();
+    auto nextRight = next->right;
+
+    if (!parent) {
+        tree->root = next;
+    } else if (node == parent->left) {
+        parent->left = next;
+    } else {
+        parent->right = next;
+    }
+    next->setParent(parent);
+
+    next->left = node->left;
+    next->left->setParent(next);
+    if (nextParent == node) {
+        next->right = node;
+        node->setParent(next);
     } else {
-        return removeChildlessNode(next);
+        next->right = node->right;
+        next->right->setParent(next);
+        nextParent->left = node;
+        node->setParent(nextParent);
+    }
+
+    node->left = nullptr;
+    node->right = nextRight;
+    if (nextRight) {
+        nextRight->setParent(node);
     }
+    auto color = node->color();
+    node->setColor(next->color());
+    next->setColor(color);
+#ifdef RBTREE_ORDER_STATISTICS
+    std::swap(node->subtreeSize, next->subtreeSize);
+#endif
 }
 
-template <class T, typename EqualTo, typename Less>
-auto RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
     findLeastLargestNodeFromNodeWithTwoChildren(node_ptr node) -> node_ptr {
     auto next = node->right;
     while (next->left) {
@@ -819,13 +2399,13 @@ auto RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
     return next;
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::RemovalMethodImplementation::fixBlackHeight(
-    node_ptr parent, ChildSide problemSide) {
-    auto grandparent = parent->parent.lock();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
+    fixBlackHeight(node_ptr parent, ChildSide problemSide) {
     auto child = (problemSide == LEFT ? parent->left : parent->right);
-    if (child && child->color == RED) {
-        child->color = BLACK;
+    if (child && child->color() == RED) {
+        child->setColor(BLACK);
+        tally(RECOLORS);
         return;
     } else if (problemSide == LEFT) {
         fixBlackHeightForLeft(parent);
@@ -834,64 +2414,74 @@ void RBTree<T, EqualTo, Less>::RemovalMethodImplementation::fixBlackHeight(
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
     fixBlackHeightForLeft(node_ptr parent) {
     auto brother = parent->right;
-    if (brother->color == RED) {
+    if (brother->color() == RED) {
         tree->leftRotate(parent);
-        auto grandparent = parent->parent.lock();
-        parent->color = RED;
-        grandparent->color = BLACK;
+        auto grandparent = parent->parent();
+        parent->setColor(RED);
+        grandparent->setColor(BLACK);
+        tally(RECOLORS, 2);
         fixBlackHeightForLeft(parent);
     } else {
         if (blackChildrenCase(brother)) {
-            brother->color = RED;
+            brother->setColor(RED);
+            tally(RECOLORS);
             runFixFromGrandFather(parent);
         } else if (redRightChildCase(brother)) {
             tree->leftRotate(parent);
-            brother->color = parent->color;
-            parent->color = brother->right->color = BLACK;
+            brother->setColor(parent->color());
+            parent->setColor(BLACK);
+            brother->right->setColor(BLACK);
+            tally(RECOLORS, 3);
         } else {
             tree->rightRotate(brother);
-            brother->color = RED;
-            brother->parent.lock()->color = BLACK;
+            brother->setColor(RED);
+            brother->parent()->setColor(BLACK);
+            tally(RECOLORS, 2);
             fixBlackHeightForLeft(parent);
         }
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
     fixBlackHeightForRight(node_ptr parent) {
     auto brother = parent->left;
-    if (brother->color == RED) {
+    if (brother->color() == RED) {
         tree->rightRotate(parent);
-        auto grandparent = parent->parent.lock();
-        parent->color = RED;
-        grandparent->color = BLACK;
+        auto grandparent = parent->parent();
+        parent->setColor(RED);
+        grandparent->setColor(BLACK);
+        tally(RECOLORS, 2);
         fixBlackHeightForRight(parent);
     } else {
         if (blackChildrenCase(brother)) {
-            brother->color = RED;
+            brother->setColor(RED);
+            tally(RECOLORS);
             runFixFromGrandFather(parent);
         } else if (redLeftChildCase(brother)) {
             tree->rightRotate(parent);
-            brother->color = parent->color;
-            parent->color = brother->left->color = BLACK;
+            brother->setColor(parent->color());
+            parent->setColor(BLACK);
+            brother->left->setColor(BLACK);
+            tally(RECOLORS, 3);
         } else {
             tree->leftRotate(brother);
-            brother->color = RED;
-            brother->parent.lock()->color = BLACK;
+            brother->setColor(RED);
+            brother->parent()->setColor(BLACK);
+            tally(RECOLORS, 2);
             fixBlackHeightForRight(parent);
         }
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
     runFixFromGrandFather(node_ptr parent) {
-    auto grandfather = parent->parent.lock();
+    auto grandfather = parent->parent();
     if (!grandfather) {
         return;
     } else if (parent == grandfather->left) {
@@ -901,33 +2491,476 @@ void RBTree<T, EqualTo, Less>::RemovalMethodImplementation::
     }
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::RemovalMethodImplementation::blackChildrenCase(
-    node_ptr node) {
-    return (!node->left || node->left->color == BLACK) &&
-           (!node->right || node->right->color == BLACK);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
+    blackChildrenCase(node_ptr node) {
+    return (!node->left || node->left->color() == BLACK) &&
+           (!node->right || node->right->color() == BLACK);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
+    redRightChildCase(node_ptr node) {
+    return (node->right && node->right->color() == RED);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool RBTree<T, EqualTo, Less, Allocator>::RemovalMethodImplementation::
+    redLeftChildCase(node_ptr node) {
+    return (node->left && node->left->color() == RED);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::clear() {
+    destroySubtree(root);
+    root = nullptr;
+    _size = 0;
+    blocks.clear();
+#ifdef RBTREE_HASH_INDEX
+    index.clear();
+#endif
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::compact(Layout layout) {
+    if (!root) {
+        blocks.clear();
+        return;
+    }
+    std::vector<node_ptr> order;
+    order.reserve(_size);
+    if (layout == BREADTH_FIRST) {
+        layoutBreadthFirst(root, order);
+    } else {
+        std::vector<node_ptr> scratch;
+        layoutVanEmdeBoas(root, heightOf(root), order, scratch);
+    }
+
+    NodeAllocator nodeAlloc(alloc);
+    auto fresh = NodeTraits::allocate(nodeAlloc, order.size());
+    // The block is given back when the last tree holding it lets go
+    Block block{std::shared_ptr<Node>(
+                    fresh,
+                    [alloc = alloc, size = order.size()](Node *nodes) {
+                        NodeAllocator nodeAlloc(alloc);
+                        NodeTraits::deallocate(nodeAlloc, nodes, size);
+                    },
+                    alloc),
+                order.size()};
+    std::size_t built = 0;
+    try {
+        // Values that might throw while moving are copied, so a failure
+        // leaves the tree as it was
+        for (; built < order.size(); ++built) {
+            auto old = order[built];
+            NodeTraits::construct(nodeAlloc, fresh + built, old->color(),
+                                  std::move_if_noexcept(old->value));
+        }
+    } catch (...) {
+        for (std::size_t i = 0; i < built; ++i) {
+            NodeTraits::destroy(nodeAlloc, fresh + i);
+        }
+        throw;
+    }
+
+    // The old parent links are not needed any more, so each old node keeps
+    // the address of its copy there while the copies are linked up
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        order[i]->parentAndColor = reinterpret_cast<std::uintptr_t>(fresh + i);
+    }
+    auto copyOf = [](node_ptr old) {
+        return old ? reinterpret_cast<node_ptr>(old->parentAndColor)
+                   : nullptr;
+    };
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        auto node = fresh + i;
+        node->left = copyOf(order[i]->left);
+        node->right = copyOf(order[i]->right);
+        for (auto child : {node->left, node->right}) {
+            if (child) {
+                child->setParent(node);
+            }
+        }
+#ifdef RBTREE_ORDER_STATISTICS
+        node->subtreeSize = order[i]->subtreeSize;
+#endif
+    }
+    root = copyOf(root);
+
+    for (auto old : order) {
+        destroyNode(old);
+    }
+    blocks.clear();
+    blocks.push_back(std::move(block));
+    rebuildIndex();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::heightOf(node_ptr root) {
+    uint64_t height = 0;
+    std::vector<std::pair<node_ptr, uint64_t>> stack;
+    if (root) {
+        stack.emplace_back(root, 1);
+    }
+    while (!stack.empty()) {
+        auto [node, depth] = stack.back();
+        stack.pop_back();
+        height = std::max(height, depth);
+        for (auto child : {node->left, node->right}) {
+            if (child) {
+                stack.emplace_back(child, depth + 1);
+            }
+        }
+    }
+    return height;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::layoutBreadthFirst(
+    node_ptr root, std::vector<node_ptr> &order) {
+    // order doubles as the queue
+    order.push_back(root);
+    for (std::size_t next = 0; next < order.size(); ++next) {
+        for (auto child : {order[next]->left, order[next]->right}) {
+            if (child) {
+                order.push_back(child);
+            }
+        }
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::layoutVanEmdeBoas(
+    node_ptr node, uint64_t height, std::vector<node_ptr> &order,
+    std::vector<node_ptr> &scratch) {
+    // Lays out the first height levels of the subtree: the top half of
+    // them, then every subtree hanging below it from left to right. The
+    // recursion halves the height, so it is only O(log log n) deep.
+    if (height == 1) {
+        order.push_back(node);
+        return;
+    }
+    auto top = height / 2;
+    layoutVanEmdeBoas(node, top, order, scratch);
+    // Deeper calls append past the roots of this level and cut the scratch
+    // back before returning
+    auto first = scratch.size();
+    collectAtDepth(node, top, scratch);
+    auto last = scratch.size();
+    for (auto i = first; i < last; ++i) {
+        layoutVanEmdeBoas(scratch[i], height - top, order, scratch);
+    }
+    scratch.resize(first);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::collectAtDepth(
+    node_ptr node, uint64_t depth, std::vector<node_ptr> &out) {
+    if (!node) {
+        return;
+    }
+    if (depth == 0) {
+        out.push_back(node);
+        return;
+    }
+    collectAtDepth(node->left, depth - 1, out);
+    collectAtDepth(node->right, depth - 1, out);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::join(RBTree &&left, RBTree &&right)
+    -> RBTree {
+    if (left.root && right.root) {
+        auto last = left.root;
+        while (last->right) {
+            last = last->right;
+        }
+        auto first = right.root;
+        while (first->left) {
+            first = first->left;
+        }
+        if (compareKeys(last->value, first->value) >= 0) {
+            throw InputNotSorted(
+                "Error: left tree has elements not less than the right one");
+        }
+    }
+    // Nodes only move between trees that share an allocator
+    RBTree other(left.alloc);
+    other = std::move(right);
+    RBTree result(left.alloc);
+    result.adoptBlocks(left);
+    result.adoptBlocks(other);
+    result._size = left._size + other._size;
+    result.root = joinPieces(left.detach(), other.detach()).root;
+    result.rebuildIndex();
+    return result;
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::RemovalMethodImplementation::redRightChildCase(
-    node_ptr node) {
-    return (node->right && node->right->color == RED);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::split(T const &value)
+    -> std::pair<RBTree, RBTree> {
+    return splitAt(value);
 }
 
-template <class T, typename EqualTo, typename Less>
-bool RBTree<T, EqualTo, Less>::RemovalMethodImplementation::redLeftChildCase(
-    node_ptr node) {
-    return (node->left && node->left->color == RED);
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto RBTree<T, EqualTo, Less, Allocator>::split(Key const &key)
+    -> std::pair<RBTree, RBTree> {
+    return splitAt(key);
 }
 
-template <class T, typename EqualTo, typename Less>
-void RBTree<T, EqualTo, Less>::clear() {
-    root.reset();
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::detach() -> Piece {
+    // Takes the nodes out and leaves the tree empty; the blocks stay
+    uint64_t height = 0;
+    for (auto node = root; node; node = node->left) {
+        height += node->color() == BLACK;
+    }
+    auto piece = pieceOf(root, height);
+    root = nullptr;
     _size = 0;
+#ifdef RBTREE_HASH_INDEX
+    index.clear();
+#endif
+    return piece;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto RBTree<T, EqualTo, Less, Allocator>::splitAt(Key const &key)
+    -> std::pair<RBTree, RBTree> {
+    std::pair<RBTree, RBTree> halves{RBTree(alloc), RBTree(alloc)};
+    auto &[less, greater] = halves;
+    auto total = _size;
+    less.blocks = blocks;
+    greater.adoptBlocks(*this);
+    auto cut = cutPiece(detach(), key);
+    if (cut.match) {
+        cut.greater = joinPieces(Piece{}, cut.match, cut.greater);
+    }
+    less.root = cut.less.root;
+    greater.root = cut.greater.root;
+    less._size = countFirst(less.root, greater.root, total);
+    greater._size = total - less._size;
+    less.rebuildIndex();
+    greater.rebuildIndex();
+    return halves;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+uint64_t RBTree<T, EqualTo, Less, Allocator>::countFirst(
+    node_ptr first, [[maybe_unused]] node_ptr second,
+    [[maybe_unused]] uint64_t total) {
+    // Size of first, given the total size of both subtrees
+#ifdef RBTREE_ORDER_STATISTICS
+    return subtreeSize(first);
+#else
+    // Counts both in turns and stops as soon as either is done, which
+    // takes as many steps as the smaller one has nodes
+    std::array<std::vector<node_ptr>, 2> stacks;
+    std::array<uint64_t, 2> counts{};
+    for (std::size_t side = 0; side < 2; ++side) {
+        if (auto root = side == 0 ? first : second) {
+            stacks[side].push_back(root);
+        }
+    }
+    while (true) {
+        for (std::size_t side = 0; side < 2; ++side) {
+            auto &stack = stacks[side];
+            if (stack.empty()) {
+                return side == 0 ? counts[0] : total - counts[1];
+            }
+            auto node = stack.back();
+            stack.pop_back();
+            ++counts[side];
+            for (auto child : {node->left, node->right}) {
+                if (child) {
+                    stack.push_back(child);
+                }
+            }
+        }
+    }
+#endif
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::pieceOf(node_ptr root,
+                                                  uint64_t height) -> Piece {
+    // A red root turns black, which adds one to every path
+    if (!root) {
+        return Piece{};
+    }
+    root->setParent(nullptr);
+    if (root->color() == RED) {
+        tally(RECOLORS);
+        root->setColor(BLACK);
+        return Piece{root, height + 1};
+    }
+    return Piece{root, height};
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void RBTree<T, EqualTo, Less, Allocator>::link(node_ptr node, node_ptr left,
+                                               node_ptr right) {
+    node->left = left;
+    node->right = right;
+    if (left) {
+        left->setParent(node);
+    }
+    if (right) {
+        right->setParent(node);
+    }
+#ifdef RBTREE_ORDER_STATISTICS
+    updateSubtreeSize(node);
+#endif
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::rotateLeftAt(node_ptr node)
+    -> node_ptr {
+    // Leaves linking the pivot to the parent to the caller
+    tally(ROTATIONS);
+    auto pivot = node->right;
+    link(node, node->left, pivot->left);
+    link(pivot, node, pivot->right);
+    return pivot;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::rotateRightAt(node_ptr node)
+    -> node_ptr {
+    tally(ROTATIONS);
+    auto pivot = node->left;
+    link(node, pivot->right, node->right);
+    link(pivot, pivot->left, node);
+    return pivot;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::joinRight(node_ptr node,
+                                                    uint64_t height,
+                                                    node_ptr middle,
+                                                    Piece right) -> node_ptr {
+    // Goes down the right spine to the first black node as high as the
+    // right piece and hangs both under middle there, colored red. A red
+    // node with a red right child may come back up; its black parent
+    // fixes that with a rotation, except at the very top.
+    if (!node || (node->color() == BLACK && height == right.height)) {
+        middle->setColor(RED);
+        link(middle, node, right.root);
+        return middle;
+    }
+    auto childHeight = node->color() == BLACK ? height - 1 : height;
+    auto child = joinRight(node->right, childHeight, middle, right);
+    link(node, node->left, child);
+    if (node->color() == BLACK && child->color() == RED && child->right &&
+        child->right->color() == RED) {
+        tally(RECOLORS);
+        child->right->setColor(BLACK);
+        return rotateLeftAt(node);
+    }
+    return node;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::joinLeft(Piece left,
+                                                   node_ptr middle,
+                                                   node_ptr node,
+                                                   uint64_t height)
+    -> node_ptr {
+    if (!node || (node->color() == BLACK && height == left.height)) {
+        middle->setColor(RED);
+        link(middle, left.root, node);
+        return middle;
+    }
+    auto childHeight = node->color() == BLACK ? height - 1 : height;
+    auto child = joinLeft(left, middle, node->left, childHeight);
+    link(node, child, node->right);
+    if (node->color() == BLACK && child->color() == RED && child->left &&
+        child->left->color() == RED) {
+        tally(RECOLORS);
+        child->left->setColor(BLACK);
+        return rotateRightAt(node);
+    }
+    return node;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::joinPieces(Piece left,
+                                                     node_ptr middle,
+                                                     Piece right) -> Piece {
+    // Everything in left is less than middle and everything in right
+    // greater; takes O(difference of the heights + 1)
+    if (left.height > right.height) {
+        return pieceOf(joinRight(left.root, left.height, middle, right),
+                       left.height);
+    }
+    if (right.height > left.height) {
+        return pieceOf(joinLeft(left, middle, right.root, right.height),
+                       right.height);
+    }
+    link(middle, left.root, right.root);
+    middle->setParent(nullptr);
+    middle->setColor(BLACK);
+    return Piece{middle, left.height + 1};
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::joinPieces(Piece left, Piece right)
+    -> Piece {
+    // Without a middle node, the last node of left becomes one
+    if (!left.root) {
+        return right;
+    }
+    if (!right.root) {
+        return left;
+    }
+    auto [rest, last] = splitLast(left);
+    return joinPieces(rest, last, right);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto RBTree<T, EqualTo, Less, Allocator>::splitLast(Piece piece)
+    -> std::pair<Piece, node_ptr> {
+    auto node = piece.root;
+    auto less = pieceOf(node->left, piece.height - 1);
+    if (!node->right) {
+        return {less, node};
+    }
+    auto [rest, last] = splitLast(pieceOf(node->right, piece.height - 1));
+    return {joinPieces(less, node, rest), last};
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto RBTree<T, EqualTo, Less, Allocator>::cutPiece(Piece piece,
+                                                   Key const &key) -> Cut {
+    // Descends towards the key and joins what hangs off the path back
+    // together on either side; the joins cost O(log n) in total, since
+    // the heights they span add up to the height of the piece
+    auto node = piece.root;
+    if (!node) {
+        return Cut{Piece{}, nullptr, Piece{}};
+    }
+    auto less = pieceOf(node->left, piece.height - 1);
+    auto greater = pieceOf(node->right, piece.height - 1);
+    auto order = compareKeys(node->value, key);
+    if (order == 0) {
+        return Cut{less, node, greater};
+    }
+    if (order > 0) {
+        auto cut = cutPiece(less, key);
+        cut.greater = joinPieces(cut.greater, node, greater);
+        return cut;
+    }
+    auto cut = cutPiece(greater, key);
+    cut.less = joinPieces(less, node, cut.less);
+    return cut;
 }
 
 #endif
 
 }; // namespace rb_tree
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,292 @@
+#ifndef RB_TREE_CONCURRENT_HPP
+#define RB_TREE_CONCURRENT_HPP
+
+#include "rb_tree_persistent.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
+namespace rb_tree {
+
+// Epoch-based reclamation for data that readers look at without locks while
+// a writer replaces it. A reader announces the epoch it reads in, in one of
+// many counters, each on its own cache line, so readers on different cores
+// never write to the same line. Nothing ever makes a reader wait: one that
+// raced with an epoch change just announces itself again. The writer
+// retires what it took out of reach under the current epoch and frees it
+// two epoch changes later, and the epoch only moves on once no reader is
+// left in the one before it, so no reader can still hold what is freed.
+// Writers have to be serialized by the caller.
+template <typename Retired>
+class EpochDomain {
+  public:
+    EpochDomain() = default;
+    EpochDomain(EpochDomain const &) = delete;
+    EpochDomain &operator=(EpochDomain const &) = delete;
+
+    // Reader side: whatever was reachable after enter() stays alive until
+    // the matching leave(), which takes the epoch enter() returned
+    uint64_t enter() const;
+    void leave(uint64_t epoch) const;
+
+    // Writer side: frees retired once no reader can reach it any more
+    void retire(std::unique_ptr<Retired> retired);
+
+  private:
+    static constexpr std::size_t slotCount = 64;
+    static constexpr std::size_t cacheLine = 64;
+
+    // Readers of epoch e count in readers[e % 3]: the current epoch, the
+    // one before it and the one being emptied for reuse
+    struct alignas(cacheLine) Slot {
+        std::array<std::atomic<uint64_t>, 3> readers{};
+    };
+
+    static std::size_t slotOfThisThread();
+    void tryAdvance();
+
+    mutable std::array<Slot, slotCount> slots;
+    std::atomic<uint64_t> epoch{0};
+    // limbo[e % 3]: retired in epoch e
+    std::array<std::vector<std::unique_ptr<Retired>>, 3> limbo;
+};
+
+// RBTree shared between any number of reader threads and writer threads.
+// The tree is a PersistentRBTree, so every change makes a new version that
+// shares all untouched nodes with the previous one. A writer builds it
+// aside and publishes it with one atomic store; readers search whichever
+// version is published when they start and never wait for a writer, not
+// even while it rebalances. Replaced versions are freed through an
+// EpochDomain once the last reader that could see them has left. Writers
+// are serialized among themselves. Values are handed to readers through a
+// callback, so no reference outlives the read.
+template <class T, typename EqualTo = std::equal_to<T>,
+          typename Less = std::less<T>, typename Allocator = std::allocator<T>>
+class ConcurrentRBTree {
+  public:
+    using tree_type = PersistentRBTree<T, EqualTo, Less, Allocator>;
+
+    ConcurrentRBTree();
+    explicit ConcurrentRBTree(Allocator const &alloc);
+    ~ConcurrentRBTree();
+
+    // Calls callback(T const &) on the found value; false on a miss
+    template <typename Key, typename Callback>
+    bool visit(Key const &key, Callback &&callback) const;
+    template <typename Key>
+    bool contains(Key const &key) const;
+
+    bool try_add(T const &value);
+    template <typename Key>
+    bool try_remove(Key const &key);
+    void clear();
+    uint64_t size() const;
+
+    // Whole-tree access for anything else. read() sees one published
+    // version, and a snapshot() taken there stays valid afterwards.
+    // write() changes a copy of the current version and publishes it when
+    // the callback returns.
+    template <typename Callback>
+    decltype(auto) read(Callback &&callback) const;
+    template <typename Callback>
+    decltype(auto) write(Callback &&callback);
+
+  private:
+    struct Version {
+        tree_type tree;
+    };
+
+    // Publishes what change does to a copy of the current version if it
+    // returns true
+    template <typename Change>
+    bool publishIf(Change &&change);
+
+    // Owned by the tree; replaced versions go to epochs
+    std::atomic<Version *> published;
+    mutable EpochDomain<Version> epochs;
+    std::mutex writers;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// EpochDomain class methods implementation
+
+template <typename Retired>
+std::size_t EpochDomain<Retired>::slotOfThisThread() {
+    static std::atomic<std::size_t> nextSlot{0};
+    thread_local std::size_t const slot =
+        nextSlot.fetch_add(1, std::memory_order_relaxed) % slotCount;
+    return slot;
+}
+
+template <typename Retired>
+uint64_t EpochDomain<Retired>::enter() const {
+    auto &slot = slots[slotOfThisThread()];
+    while (true) {
+        // Announce first, then check: together with the writer doing the
+        // opposite, either the writer sees this reader or the reader sees
+        // the new epoch and announces itself there instead
+        auto current = epoch.load(std::memory_order_seq_cst);
+        auto &readers = slot.readers[current % 3];
+        readers.fetch_add(1, std::memory_order_seq_cst);
+        if (epoch.load(std::memory_order_seq_cst) == current) {
+            return current;
+        }
+        readers.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+template <typename Retired>
+void EpochDomain<Retired>::leave(uint64_t epoch) const {
+    slots[slotOfThisThread()].readers[epoch % 3].fetch_sub(
+        1, std::memory_order_release);
+}
+
+template <typename Retired>
+void EpochDomain<Retired>::retire(std::unique_ptr<Retired> retired) {
+    limbo[epoch.load(std::memory_order_relaxed) % 3].push_back(
+        std::move(retired));
+    tryAdvance();
+}
+
+template <typename Retired>
+void EpochDomain<Retired>::tryAdvance() {
+    // Readers of the current epoch may still hold what was retired in it
+    // or in the one before, so the epoch moves on only once the one before
+    // has no readers left. What was retired there is then out of reach.
+    auto current = epoch.load(std::memory_order_relaxed);
+    auto previous = (current + 2) % 3;
+    for (auto const &slot : slots) {
+        if (slot.readers[previous].load(std::memory_order_seq_cst) != 0) {
+            return;
+        }
+    }
+    epoch.store(current + 1, std::memory_order_seq_cst);
+    limbo[previous].clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// ConcurrentRBTree class methods implementation
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+ConcurrentRBTree<T, EqualTo, Less, Allocator>::ConcurrentRBTree()
+    : ConcurrentRBTree(Allocator()) {}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+ConcurrentRBTree<T, EqualTo, Less, Allocator>::ConcurrentRBTree(
+    Allocator const &alloc)
+    : published(new Version{tree_type(alloc)}) {}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+ConcurrentRBTree<T, EqualTo, Less, Allocator>::~ConcurrentRBTree() {
+    delete published.load(std::memory_order_relaxed);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key, typename Callback>
+bool ConcurrentRBTree<T, EqualTo, Less, Allocator>::visit(
+    Key const &key, Callback &&callback) const {
+    return read([&](tree_type const &tree) {
+        auto found = tree.try_find(key);
+        if (!found) {
+            return false;
+        }
+        callback(*found);
+        return true;
+    });
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+bool ConcurrentRBTree<T, EqualTo, Less, Allocator>::contains(
+    Key const &key) const {
+    return read([&](tree_type const &tree) {
+        return tree.try_find(key) != nullptr;
+    });
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool ConcurrentRBTree<T, EqualTo, Less, Allocator>::try_add(T const &value) {
+    return publishIf([&](tree_type &tree) { return tree.try_add(value); });
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+bool ConcurrentRBTree<T, EqualTo, Less, Allocator>::try_remove(
+    Key const &key) {
+    return publishIf([&](tree_type &tree) { return tree.try_remove(key); });
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void ConcurrentRBTree<T, EqualTo, Less, Allocator>::clear() {
+    publishIf([](tree_type &tree) {
+        tree.clear();
+        return true;
+    });
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+uint64_t ConcurrentRBTree<T, EqualTo, Less, Allocator>::size() const {
+    return read([](tree_type const &tree) { return tree.size(); });
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Callback>
+decltype(auto) ConcurrentRBTree<T, EqualTo, Less, Allocator>::read(
+    Callback &&callback) const {
+    struct Leave {
+        EpochDomain<Version> const &epochs;
+        uint64_t epoch;
+        ~Leave() { epochs.leave(epoch); }
+    } guard{epochs, epochs.enter()};
+    // Sequentially consistent like the epoch counters, so that a writer
+    // that missed this reader also finds it reading the new version
+    auto version = published.load(std::memory_order_seq_cst);
+    return callback(static_cast<tree_type const &>(version->tree));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Callback>
+decltype(auto)
+ConcurrentRBTree<T, EqualTo, Less, Allocator>::write(Callback &&callback) {
+    using Result = std::invoke_result_t<Callback &, tree_type &>;
+    if constexpr (std::is_void_v<Result>) {
+        publishIf([&](tree_type &tree) {
+            callback(tree);
+            return true;
+        });
+    } else {
+        std::optional<Result> result;
+        publishIf([&](tree_type &tree) {
+            result.emplace(callback(tree));
+            return true;
+        });
+        return Result(std::move(*result));
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Change>
+bool ConcurrentRBTree<T, EqualTo, Less, Allocator>::publishIf(
+    Change &&change) {
+    std::lock_guard guard(writers);
+    auto current = published.load(std::memory_order_relaxed);
+    // Copying the version only copies its root handle
+    auto next = std::make_unique<Version>(*current);
+    if (!change(next->tree)) {
+        return false;
+    }
+    published.store(next.release(), std::memory_order_seq_cst);
+    epochs.retire(std::unique_ptr<Version>(current));
+    return true;
+}
+
+}; // namespace rb_tree
+
+#endif
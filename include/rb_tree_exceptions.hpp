@@ -47,6 +47,29 @@ class NoLeafParentElementInTree : public std::runtime_error {
     NoLeafParentElementInTree(std::string const &message)
         : std::runtime_error(message) {}
 };
+
+class CanNotMapFile : public std::runtime_error {
+  public:
+    CanNotMapFile(std::string const &message) : std::runtime_error(message) {}
+};
+
+class SnapshotCorrupted : public std::runtime_error {
+  public:
+    SnapshotCorrupted(std::string const &message)
+        : std::runtime_error(message) {}
+};
+
+class InputNotSorted : public std::runtime_error {
+  public:
+    InputNotSorted(std::string const &message)
+        : std::runtime_error(message) {}
+};
+
+class BatchSizeMismatch : public std::runtime_error {
+  public:
+    BatchSizeMismatch(std::string const &message)
+        : std::runtime_error(message) {}
+};
 }; // namespace rb_tree
 
 #endif
\ No newline at end of file
@@ -0,0 +1,216 @@
+#ifndef RB_TREE_HASH_INDEX_HPP
+#define RB_TREE_HASH_INDEX_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace rb_tree {
+
+// Open-addressing table from hashes to pointers, kept beside a tree so that
+// exact-match lookups can skip the descent. Slots hold the full hash, so
+// probing and growing never touch the values pointed to, and linear probing
+// with backward-shift deletion leaves no tombstones behind. The table never
+// owns what it points to.
+template <typename Pointer, typename Allocator = std::allocator<Pointer>>
+class HashIndex {
+  public:
+    HashIndex() = default;
+    explicit HashIndex(Allocator const &alloc);
+    HashIndex(HashIndex &&other);
+
+    HashIndex &operator=(HashIndex &&other);
+
+    // First pointer stored under the hash for which match(pointer) holds,
+    // or nullptr
+    template <typename Match>
+    Pointer find(uint64_t hash, Match &&match) const;
+    // Expects the pointer not to be in the table yet
+    void insert(uint64_t hash, Pointer pointer);
+    void erase(uint64_t hash, Pointer pointer);
+    void reserve(std::size_t count);
+    void clear();
+    // Pulls in the slot a lookup of the hash starts at
+    void prefetch(uint64_t hash) const;
+
+    std::size_t size() const;
+
+  private:
+    struct Slot {
+        uint64_t hash = 0;
+        // nullptr marks a free slot
+        Pointer pointer = nullptr;
+    };
+    using SlotAllocator = typename std::allocator_traits<
+        Allocator>::template rebind_alloc<Slot>;
+
+    // Grows past three quarters full, which keeps probe runs short
+    static constexpr std::size_t minCapacity = 16;
+    static std::size_t capacityFor(std::size_t count);
+
+    std::size_t home(uint64_t hash) const;
+    void place(uint64_t hash, Pointer pointer);
+    void rehash(std::size_t capacity);
+
+    std::vector<Slot, SlotAllocator> slots;
+    std::size_t count = 0;
+    // slots.size() is 2^bits, or 0 before the first insert
+    int bits = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// HashIndex class methods implementation
+
+template <typename Pointer, typename Allocator>
+HashIndex<Pointer, Allocator>::HashIndex(Allocator const &alloc)
+    : slots(SlotAllocator(alloc)) {}
+
+template <typename Pointer, typename Allocator>
+HashIndex<Pointer, Allocator>::HashIndex(HashIndex &&other)
+    : slots(std::move(other.slots)), count(std::exchange(other.count, 0)),
+      bits(std::exchange(other.bits, 0)) {
+    other.slots.clear();
+}
+
+template <typename Pointer, typename Allocator>
+auto HashIndex<Pointer, Allocator>::operator=(HashIndex &&other)
+    -> HashIndex & {
+    if (this != &other) {
+        slots = std::move(other.slots);
+        count = std::exchange(other.count, 0);
+        bits = std::exchange(other.bits, 0);
+        other.slots.clear();
+    }
+    return *this;
+}
+
+template <typename Pointer, typename Allocator>
+template <typename Match>
+Pointer HashIndex<Pointer, Allocator>::find(uint64_t hash,
+                                            Match &&match) const {
+    if (count == 0) {
+        return nullptr;
+    }
+    auto mask = slots.size() - 1;
+    for (auto i = home(hash);; i = (i + 1) & mask) {
+        auto const &slot = slots[i];
+        if (!slot.pointer) {
+            return nullptr;
+        }
+        if (slot.hash == hash && match(slot.pointer)) {
+            return slot.pointer;
+        }
+    }
+}
+
+template <typename Pointer, typename Allocator>
+void HashIndex<Pointer, Allocator>::insert(uint64_t hash, Pointer pointer) {
+    if (capacityFor(count + 1) > slots.size()) {
+        rehash(std::max(slots.size() * 2, minCapacity));
+    }
+    place(hash, pointer);
+    ++count;
+}
+
+template <typename Pointer, typename Allocator>
+void HashIndex<Pointer, Allocator>::erase(uint64_t hash, Pointer pointer) {
+    if (count == 0) {
+        return;
+    }
+    auto mask = slots.size() - 1;
+    auto hole = home(hash);
+    for (; slots[hole].pointer != pointer; hole = (hole + 1) & mask) {
+        if (!slots[hole].pointer) {
+            return;
+        }
+    }
+    // Later entries of the run move back into the hole, unless that would
+    // put one before its home slot
+    for (auto i = (hole + 1) & mask; slots[i].pointer; i = (i + 1) & mask) {
+        auto fromHome = (i - home(slots[i].hash)) & mask;
+        if (fromHome >= ((i - hole) & mask)) {
+            slots[hole] = slots[i];
+            hole = i;
+        }
+    }
+    slots[hole] = Slot{};
+    --count;
+}
+
+template <typename Pointer, typename Allocator>
+void HashIndex<Pointer, Allocator>::reserve(std::size_t count) {
+    auto capacity = capacityFor(count);
+    if (capacity > slots.size()) {
+        rehash(capacity);
+    }
+}
+
+template <typename Pointer, typename Allocator>
+void HashIndex<Pointer, Allocator>::clear() {
+    // Gives the memory back, as clearing the tree does
+    std::vector<Slot, SlotAllocator>(slots.get_allocator()).swap(slots);
+    count = 0;
+    bits = 0;
+}
+
+template <typename Pointer, typename Allocator>
+void HashIndex<Pointer, Allocator>::prefetch(uint64_t hash) const {
+#if defined(__GNUC__) || defined(__clang__)
+    if (count != 0) {
+        __builtin_prefetch(&slots[home(hash)]);
+    }
+#else
+    (void)hash;
+#endif
+}
+
+template <typename Pointer, typename Allocator>
+std::size_t HashIndex<Pointer, Allocator>::size() const {
+    return count;
+}
+
+template <typename Pointer, typename Allocator>
+std::size_t HashIndex<Pointer, Allocator>::capacityFor(std::size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    return std::max(std::bit_ceil(count + count / 3 + 1), minCapacity);
+}
+
+template <typename Pointer, typename Allocator>
+std::size_t HashIndex<Pointer, Allocator>::home(uint64_t hash) const {
+    // Fibonacci hashing: the top bits of the product depend on every bit
+    // of the hash, so even identity hashes of integers spread out
+    return static_cast<std::size_t>((hash * 0x9E3779B97F4A7C15ull) >>
+                                    (64 - bits));
+}
+
+template <typename Pointer, typename Allocator>
+void HashIndex<Pointer, Allocator>::place(uint64_t hash, Pointer pointer) {
+    auto mask = slots.size() - 1;
+    auto i = home(hash);
+    while (slots[i].pointer) {
+        i = (i + 1) & mask;
+    }
+    slots[i] = Slot{hash, pointer};
+}
+
+template <typename Pointer, typename Allocator>
+void HashIndex<Pointer, Allocator>::rehash(std::size_t capacity) {
+    std::vector<Slot, SlotAllocator> old(capacity, slots.get_allocator());
+    old.swap(slots);
+    bits = std::countr_zero(capacity);
+    for (auto const &slot : old) {
+        if (slot.pointer) {
+            place(slot.hash, slot.pointer);
+        }
+    }
+}
+
+}; // namespace rb_tree
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef RB_TREE_MAPPED_FILE_HPP
+#define RB_TREE_MAPPED_FILE_HPP
+
+#include "rb_tree_exceptions.hpp"
+#include <cstddef>
+#include <span>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rb_tree {
+
+// Read-only memory mapping of a whole file. POSIX only, so it is kept out
+// of rb_tree_snapshot.hpp and the trees build anywhere.
+class MappedFile {
+  public:
+    explicit MappedFile(std::string const &path);
+    MappedFile(MappedFile const &) = delete;
+    MappedFile &operator=(MappedFile const &) = delete;
+    ~MappedFile();
+
+    std::span<char const> data() const;
+
+  private:
+    void *address = nullptr;
+    std::size_t length = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// MappedFile class methods implementation
+
+inline MappedFile::MappedFile(std::string const &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw CanNotMapFile("Error: Cannot open file");
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw CanNotMapFile("Error: Cannot open file");
+    }
+    length = static_cast<std::size_t>(info.st_size);
+    if (length > 0) {
+        address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) {
+            address = nullptr;
+            ::close(fd);
+            throw CanNotMapFile("Error: Cannot map file");
+        }
+        // The records are read front to back exactly once
+        ::madvise(address, length, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+}
+
+inline MappedFile::~MappedFile() {
+    if (address) {
+        ::munmap(address, length);
+    }
+}
+
+inline std::span<char const> MappedFile::data() const {
+    return {static_cast<char const *>(address), length};
+}
+
+}; // namespace rb_tree
+
+#endif
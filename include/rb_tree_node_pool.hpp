@@ -0,0 +1,165 @@
+#ifndef RB_TREE_NODE_POOL_HPP
+#define RB_TREE_NODE_POOL_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+namespace rb_tree {
+
+// Slab memory resource for tree nodes. Blocks of the same size are cut from
+// large slabs and recycled through an intrusive free list, so a removed node
+// is reused by the next insertion. release() returns every slab at once.
+// Not thread-safe, like std::pmr::unsynchronized_pool_resource.
+class NodePool : public std::pmr::memory_resource {
+  public:
+    explicit NodePool(std::size_t blocksPerSlab = 1024,
+                      std::pmr::memory_resource *upstream =
+                          std::pmr::new_delete_resource());
+    NodePool(NodePool const &) = delete;
+    NodePool &operator=(NodePool const &) = delete;
+    ~NodePool() override;
+
+    void release();
+
+    std::size_t slabCount() const;
+    std::size_t blocksInUse() const;
+
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void *p, std::size_t bytes,
+                       std::size_t alignment) override;
+    bool do_is_equal(
+        std::pmr::memory_resource const &other) const noexcept override;
+
+  private:
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    struct SizeClass {
+        std::size_t blockSize;
+        std::size_t alignment;
+        FreeBlock *freeList;
+        std::byte *cursor;
+        std::byte *end;
+    };
+
+    struct Slab {
+        void *memory;
+        std::size_t bytes;
+        std::size_t alignment;
+    };
+
+    static constexpr std::size_t maxBlockSize = 1024;
+
+    static std::size_t blockSizeFor(std::size_t bytes, std::size_t alignment);
+    SizeClass &sizeClassFor(std::size_t bytes, std::size_t alignment);
+    void grow(SizeClass &sizeClass);
+
+    std::size_t const blocksPerSlab;
+    std::pmr::memory_resource *const upstream;
+    std::vector<SizeClass> sizeClasses;
+    std::vector<Slab> slabs;
+    std::size_t inUse = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// NodePool class methods implementation
+
+inline NodePool::NodePool(std::size_t blocksPerSlab,
+                          std::pmr::memory_resource *upstream)
+    : blocksPerSlab(blocksPerSlab ? blocksPerSlab : 1), upstream(upstream) {}
+
+inline NodePool::~NodePool() { release(); }
+
+inline void NodePool::release() {
+    for (auto const &slab : slabs) {
+        upstream->deallocate(slab.memory, slab.bytes, slab.alignment);
+    }
+    slabs.clear();
+    sizeClasses.clear();
+    inUse = 0;
+}
+
+inline std::size_t NodePool::slabCount() const { return slabs.size(); }
+
+inline std::size_t NodePool::blocksInUse() const { return inUse; }
+
+inline void *NodePool::do_allocate(std::size_t bytes, std::size_t alignment) {
+    if (blockSizeFor(bytes, alignment) > maxBlockSize) {
+        return upstream->allocate(bytes, alignment);
+    }
+    auto &sizeClass = sizeClassFor(bytes, alignment);
+    ++inUse;
+    if (sizeClass.freeList) {
+        auto block = sizeClass.freeList;
+        sizeClass.freeList = block->next;
+        return block;
+    }
+    if (sizeClass.cursor == sizeClass.end) {
+        grow(sizeClass);
+    }
+    auto block = sizeClass.cursor;
+    sizeClass.cursor += sizeClass.blockSize;
+    return block;
+}
+
+inline void NodePool::do_deallocate(void *p, std::size_t bytes,
+                                    std::size_t alignment) {
+    if (blockSizeFor(bytes, alignment) > maxBlockSize) {
+        upstream->deallocate(p, bytes, alignment);
+        return;
+    }
+    auto &sizeClass = sizeClassFor(bytes, alignment);
+    auto block = static_cast<FreeBlock *>(p);
+    block->next = sizeClass.freeList;
+    sizeClass.freeList = block;
+    --inUse;
+}
+
+inline bool NodePool::do_is_equal(
+    std::pmr::memory_resource const &other) const noexcept {
+    return this == &other;
+}
+
+inline std::size_t NodePool::blockSizeFor(std::size_t bytes,
+                                          std::size_t alignment) {
+    if (alignment < alignof(FreeBlock)) {
+        alignment = alignof(FreeBlock);
+    }
+    if (bytes < sizeof(FreeBlock)) {
+        bytes = sizeof(FreeBlock);
+    }
+    return (bytes + alignment - 1) / alignment * alignment;
+}
+
+inline auto NodePool::sizeClassFor(std::size_t bytes, std::size_t alignment)
+    -> SizeClass & {
+    auto blockSize = blockSizeFor(bytes, alignment);
+    // A tree only ever asks for a couple of distinct sizes
+    for (auto &sizeClass : sizeClasses) {
+        if (sizeClass.blockSize == blockSize &&
+            sizeClass.alignment >= alignment) {
+            return sizeClass;
+        }
+    }
+    if (alignment < alignof(FreeBlock)) {
+        alignment = alignof(FreeBlock);
+    }
+    sizeClasses.push_back({blockSize, alignment, nullptr, nullptr, nullptr});
+    return sizeClasses.back();
+}
+
+inline void NodePool::grow(SizeClass &sizeClass) {
+    auto bytes = sizeClass.blockSize * blocksPerSlab;
+    auto memory = upstream->allocate(bytes, sizeClass.alignment);
+    slabs.push_back({memory, bytes, sizeClass.alignment});
+    sizeClass.cursor = static_cast<std::byte *>(memory);
+    sizeClass.end = sizeClass.cursor + bytes;
+}
+
+}; // namespace rb_tree
+
+#endif
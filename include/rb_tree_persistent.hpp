@@ -0,0 +1,693 @@
+#ifndef RB_TREE_PERSISTENT_HPP
+#define RB_TREE_PERSISTENT_HPP
+
+#include "rb_tree.hpp"
+#include <memory>
+#include <vector>
+
+namespace rb_tree {
+
+// Red-black tree with immutable nodes. add and remove copy only the nodes on
+// the path from the root to the change and share everything else with the
+// previous version, so a snapshot is just another handle to the same root:
+// taking one is O(1), and it can be read or saved on another thread while
+// the original keeps changing.
+//
+// Rebalancing follows Okasaki's insertion and Kahrs' deletion, which are
+// written for persistent trees. Nodes have no parent links, since a node is
+// shared by every version that contains it.
+template <class T, typename EqualTo = std::equal_to<T>,
+          typename Less = std::less<T>, typename Allocator = std::allocator<T>>
+class PersistentRBTree {
+  protected:
+    enum Color { BLACK, RED };
+
+    struct Node;
+    using node_ptr = std::shared_ptr<Node const>;
+
+  public:
+    using value_ptr = std::shared_ptr<T const>;
+    using allocator_type = Allocator;
+
+    class const_iterator;
+    using iterator = const_iterator;
+
+    PersistentRBTree() = default;
+    explicit PersistentRBTree(Allocator const &alloc);
+
+    // Copies are snapshots: they share all nodes and never see later changes
+    PersistentRBTree snapshot() const;
+
+    T const &find(T const &value) const;
+    value_ptr find_shared(T const &value) const;
+    void add(T const &value);
+    value_ptr remove(T const &value);
+
+    T const *try_find(T const &value) const;
+    bool try_add(T const &value);
+    bool try_remove(T const &value);
+
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    T const &find(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    value_ptr find_shared(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    value_ptr remove(Key const &key);
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    T const *try_find(Key const &key) const;
+    template <typename Key>
+        requires Transparent<EqualTo> && Transparent<Less>
+    bool try_remove(Key const &key);
+
+    // In-order iteration over this version; other versions may change freely
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    bool empty() const;
+    uint64_t size() const;
+    void clear();
+
+    allocator_type get_allocator() const;
+
+    bool operator==(PersistentRBTree const &other) const;
+
+    // Same format as RBTree::saveToBinary, so either tree reads the other's
+    // files
+    void saveToBinary(std::ostream &os) const
+        requires Serializable<T>;
+    static PersistentRBTree
+    readFromBinary(std::istream &is, Allocator const &alloc = Allocator())
+        requires Serializable<T>;
+
+  protected:
+    template <typename Key>
+    node_ptr const *findLink(Key const &key) const;
+    template <typename Key>
+    static auto compareKeys(T const &value, Key const &key);
+
+    node_ptr makeNode(Color color, node_ptr left, T const &value,
+                      node_ptr right) const;
+    static bool isRed(node_ptr const &node);
+    static bool isBlack(node_ptr const &node);
+    node_ptr withColor(node_ptr const &node, Color color) const;
+
+    node_ptr insertInto(node_ptr const &node, T const &value) const;
+    template <typename Key>
+    node_ptr removeFrom(node_ptr const &node, Key const &key) const;
+    template <typename Key> value_ptr removeKey(Key const &key);
+
+    node_ptr balance(node_ptr const &left, T const &value,
+                     node_ptr const &right) const;
+    node_ptr balanceLeft(node_ptr const &left, T const &value,
+                         node_ptr const &right) const;
+    node_ptr balanceRight(node_ptr const &left, T const &value,
+                          node_ptr const &right) const;
+    node_ptr fuse(node_ptr const &left, node_ptr const &right) const;
+
+  protected:
+    node_ptr root;
+    uint64_t _size = 0;
+    Allocator alloc;
+};
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+struct PersistentRBTree<T, EqualTo, Less, Allocator>::Node {
+    Node(Color color, node_ptr left, T const &value, node_ptr right)
+        : left(std::move(left)), right(std::move(right)), color(color),
+          value(value) {}
+
+    node_ptr left;
+    node_ptr right;
+    Color color;
+    T value;
+};
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+class PersistentRBTree<T, EqualTo, Less, Allocator>::const_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T const *;
+    using reference = T const &;
+
+    const_iterator() = default;
+
+    reference operator*() const;
+    pointer operator->() const;
+
+    const_iterator &operator++();
+    const_iterator operator++(int);
+
+    bool operator==(const_iterator const &other) const;
+
+  private:
+    friend class PersistentRBTree;
+
+    void pushLeftSpine(Node const *node);
+
+    // Keeps the version alive while it is being iterated
+    node_ptr root;
+    std::vector<Node const *> path;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// PersistentRBTree class methods implementation
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+PersistentRBTree<T, EqualTo, Less, Allocator>::PersistentRBTree(
+    Allocator const &alloc)
+    : alloc(alloc) {}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::snapshot() const
+    -> PersistentRBTree {
+    return *this;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::find(T const &value) const
+    -> T const & {
+    auto found = try_find(value);
+    if (!found) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return *found;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::find_shared(
+    T const &value) const -> value_ptr {
+    auto link = findLink(value);
+    if (!link) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return value_ptr(*link, &(*link)->value);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void PersistentRBTree<T, EqualTo, Less, Allocator>::add(T const &value) {
+    if (!try_add(value)) {
+        throw TreeHasGivenElement("Error: tree has element with given value");
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::remove(T const &value)
+    -> value_ptr {
+    if (empty()) {
+        throw TreeEmpty("Error: can not remove node from empty RBTree!");
+    }
+    auto removed = removeKey(value);
+    if (!removed) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return removed;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::try_find(
+    T const &value) const -> T const * {
+    auto link = findLink(value);
+    return link ? &(*link)->value : nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool PersistentRBTree<T, EqualTo, Less, Allocator>::try_add(T const &value) {
+    // A duplicate must leave the tree as it is, so look before copying
+    if (findLink(value)) {
+        return false;
+    }
+    root = withColor(insertInto(root, value), BLACK);
+    ++_size;
+    return true;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool PersistentRBTree<T, EqualTo, Less, Allocator>::try_remove(
+    T const &value) {
+    return removeKey(value) != nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::find(Key const &key) const
+    -> T const & {
+    auto found = try_find(key);
+    if (!found) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return *found;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::find_shared(
+    Key const &key) const -> value_ptr {
+    auto link = findLink(key);
+    if (!link) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return value_ptr(*link, &(*link)->value);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::remove(Key const &key)
+    -> value_ptr {
+    if (empty()) {
+        throw TreeEmpty("Error: can not remove node from empty RBTree!");
+    }
+    auto removed = removeKey(key);
+    if (!removed) {
+        throw NoSuchElement("Error: no such element in RBTree!");
+    }
+    return removed;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::try_find(
+    Key const &key) const -> T const * {
+    auto link = findLink(key);
+    return link ? &(*link)->value : nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+    requires Transparent<EqualTo> && Transparent<Less>
+bool PersistentRBTree<T, EqualTo, Less, Allocator>::try_remove(
+    Key const &key) {
+    return removeKey(key) != nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::begin() const
+    -> const_iterator {
+    const_iterator it;
+    it.root = root;
+    it.pushLeftSpine(root.get());
+    return it;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::end() const
+    -> const_iterator {
+    return const_iterator();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool PersistentRBTree<T, EqualTo, Less, Allocator>::empty() const {
+    return !root;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+uint64_t PersistentRBTree<T, EqualTo, Less, Allocator>::size() const {
+    return _size;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void PersistentRBTree<T, EqualTo, Less, Allocator>::clear() {
+    // Nodes still shared with snapshots stay alive through them
+    root.reset();
+    _size = 0;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::get_allocator() const
+    -> allocator_type {
+    return alloc;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool PersistentRBTree<T, EqualTo, Less, Allocator>::operator==(
+    PersistentRBTree const &other) const {
+    std::vector<std::pair<Node const *, Node const *>> stack;
+    stack.emplace_back(root.get(), other.root.get());
+    while (!stack.empty()) {
+        auto [n1, n2] = stack.back();
+        stack.pop_back();
+        // Shared subtrees are equal without looking inside
+        if (n1 == n2) {
+            continue;
+        }
+        if (!n1 || !n2 || n1->color != n2->color ||
+            !EqualTo()(n1->value, n2->value)) {
+            return false;
+        }
+        stack.emplace_back(n1->right.get(), n2->right.get());
+        stack.emplace_back(n1->left.get(), n2->left.get());
+    }
+    return true;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void PersistentRBTree<T, EqualTo, Less, Allocator>::saveToBinary(
+    std::ostream &os) const
+    requires Serializable<T>
+{
+    uint64_t size = _size;
+    os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    std::vector<Node const *> stack{root.get()};
+    while (!stack.empty()) {
+        auto current = stack.back();
+        stack.pop_back();
+        bool exists = current != nullptr;
+        os.write(reinterpret_cast<const char *>(&exists), sizeof(exists));
+        if (exists) {
+            char color = static_cast<char>(current->color);
+            os.write(&color, sizeof(color));
+            current->value.serialize(os);
+            stack.push_back(current->right.get());
+            stack.push_back(current->left.get());
+        }
+    }
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::readFromBinary(
+    std::istream &is, Allocator const &alloc) -> PersistentRBTree
+    requires Serializable<T>
+{
+    PersistentRBTree tree(alloc);
+    is.read(reinterpret_cast<char *>(&tree._size), sizeof(tree._size));
+    // Nodes are not shared with anyone yet, so links are filled in after
+    // their owners have been created
+    std::vector<node_ptr *> stack{&tree.root};
+    while (!stack.empty()) {
+        auto link = stack.back();
+        stack.pop_back();
+        bool exists;
+        is.read(reinterpret_cast<char *>(&exists), sizeof(exists));
+        if (!exists) {
+            continue;
+        }
+        char color;
+        is.read(&color, sizeof(color));
+        auto node = std::allocate_shared<Node>(
+            alloc, static_cast<Color>(color), nullptr, T::deserialize(is),
+            nullptr);
+        *link = node;
+        stack.push_back(&node->right);
+        stack.push_back(&node->left);
+    }
+    return tree;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::findLink(
+    Key const &key) const -> node_ptr const * {
+    auto link = &root;
+    while (*link) {
+        auto const &node = **link;
+        auto order = compareKeys(node.value, key);
+        if (order == 0) {
+            return link;
+        }
+        link = order < 0 ? &node.right : &node.left;
+    }
+    return nullptr;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::compareKeys(
+    T const &value, Key const &key) {
+    return compareWith<EqualTo, Less>(value, key);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::makeNode(
+    Color color, node_ptr left, T const &value, node_ptr right) const
+    -> node_ptr {
+    return std::allocate_shared<Node>(alloc, color, std::move(left), value,
+                                      std::move(right));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool PersistentRBTree<T, EqualTo, Less, Allocator>::isRed(
+    node_ptr const &node) {
+    return node && node->color == RED;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool PersistentRBTree<T, EqualTo, Less, Allocator>::isBlack(
+    node_ptr const &node) {
+    return node && node->color == BLACK;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::withColor(
+    node_ptr const &node, Color color) const -> node_ptr {
+    if (!node || node->color == color) {
+        return node;
+    }
+    return makeNode(color, node->left, node->value, node->right);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::insertInto(
+    node_ptr const &node, T const &value) const -> node_ptr {
+    // The value is known to be absent, so the descent always ends in a leaf
+    if (!node) {
+        return makeNode(RED, nullptr, value, nullptr);
+    }
+    if (compareKeys(node->value, value) > 0) {
+        auto left = insertInto(node->left, value);
+        if (node->color == BLACK) {
+            return balance(left, node->value, node->right);
+        }
+        return makeNode(RED, std::move(left), node->value, node->right);
+    }
+    auto right = insertInto(node->right, value);
+    if (node->color == BLACK) {
+        return balance(node->left, node->value, right);
+    }
+    return makeNode(RED, node->left, node->value, std::move(right));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::removeKey(Key const &key)
+    -> value_ptr {
+    auto link = findLink(key);
+    if (!link) {
+        return nullptr;
+    }
+    // The old node is left untouched, so it can still hand out its value
+    value_ptr removed(*link, &(*link)->value);
+    root = withColor(removeFrom(root, key), BLACK);
+    --_size;
+    return removed;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Key>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::removeFrom(
+    node_ptr const &node, Key const &key) const -> node_ptr {
+    // The key is known to be present, so node is never empty here
+    auto order = compareKeys(node->value, key);
+    if (order > 0) {
+        auto left = removeFrom(node->left, key);
+        if (isBlack(node->left)) {
+            return balanceLeft(left, node->value, node->right);
+        }
+        return makeNode(RED, std::move(left), node->value, node->right);
+    } else if (order < 0) {
+        auto right = removeFrom(node->right, key);
+        if (isBlack(node->right)) {
+            return balanceRight(node->left, node->value, right);
+        }
+        return makeNode(RED, node->left, node->value, std::move(right));
+    }
+    return fuse(node->left, node->right);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::balance(
+    node_ptr const &left, T const &value, node_ptr const &right) const
+    -> node_ptr {
+    // Any red-red pair below a black node becomes a red node with two black
+    // children
+    if (isRed(left) && isRed(right)) {
+        return makeNode(RED, withColor(left, BLACK), value,
+                        withColor(right, BLACK));
+    }
+    if (isRed(left)) {
+        if (isRed(left->left)) {
+            return makeNode(RED, withColor(left->left, BLACK), left->value,
+                            makeNode(BLACK, left->right, value, right));
+        }
+        if (isRed(left->right)) {
+            auto const &middle = left->right;
+            return makeNode(
+                RED,
+                makeNode(BLACK, left->left, left->value, middle->left),
+                middle->value,
+                makeNode(BLACK, middle->right, value, right));
+        }
+    }
+    if (isRed(right)) {
+        if (isRed(right->right)) {
+            return makeNode(RED, makeNode(BLACK, left, value, right->left),
+                            right->value, withColor(right->right, BLACK));
+        }
+        if (isRed(right->left)) {
+            auto const &middle = right->left;
+            return makeNode(
+                RED, makeNode(BLACK, left, value, middle->left),
+                middle->value,
+                makeNode(BLACK, middle->right, right->value, right->right));
+        }
+    }
+    return makeNode(BLACK, left, value, right);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::balanceLeft(
+    node_ptr const &left, T const &value, node_ptr const &right) const
+    -> node_ptr {
+    // The left subtree has lost one black node
+    if (isRed(left)) {
+        return makeNode(RED, withColor(left, BLACK), value, right);
+    }
+    if (isBlack(right)) {
+        return balance(left, value, withColor(right, RED));
+    }
+    // right is red with a black left child
+    auto const &middle = right->left;
+    return makeNode(RED, makeNode(BLACK, left, value, middle->left),
+                    middle->value,
+                    balance(middle->right, right->value,
+                            withColor(right->right, RED)));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::balanceRight(
+    node_ptr const &left, T const &value, node_ptr const &right) const
+    -> node_ptr {
+    // Mirror of balanceLeft
+    if (isRed(right)) {
+        return makeNode(RED, left, value, withColor(right, BLACK));
+    }
+    if (isBlack(left)) {
+        return balance(withColor(left, RED), value, right);
+    }
+    auto const &middle = left->right;
+    return makeNode(RED,
+                    balance(withColor(left->left, RED), left->value,
+                            middle->left),
+                    middle->value,
+                    makeNode(BLACK, middle->right, value, right));
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::fuse(
+    node_ptr const &left, node_ptr const &right) const -> node_ptr {
+    // Joins the two subtrees of a removed node, which have equal black
+    // heights
+    if (!left) {
+        return right;
+    }
+    if (!right) {
+        return left;
+    }
+    if (isBlack(left) && isRed(right)) {
+        return makeNode(RED, fuse(left, right->left), right->value,
+                        right->right);
+    }
+    if (isRed(left) && isBlack(right)) {
+        return makeNode(RED, left->left, left->value,
+                        fuse(left->right, right));
+    }
+    auto middle = fuse(left->right, right->left);
+    if (isRed(middle)) {
+        // Both outer nodes keep their color around the lifted middle node
+        auto color = left->color;
+        return makeNode(
+            RED, makeNode(color, left->left, left->value, middle->left),
+            middle->value,
+            makeNode(color, middle->right, right->value, right->right));
+    }
+    if (isRed(left)) {
+        return makeNode(
+            RED, left->left, left->value,
+            makeNode(RED, std::move(middle), right->value, right->right));
+    }
+    return balanceLeft(
+        left->left, left->value,
+        makeNode(BLACK, std::move(middle), right->value, right->right));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// const_iterator class methods implementation
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less, Allocator>::const_iterator::operator*()
+    const -> reference {
+    return path.back()->value;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less,
+                      Allocator>::const_iterator::operator->() const
+    -> pointer {
+    return &path.back()->value;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less,
+                      Allocator>::const_iterator::operator++()
+    -> const_iterator & {
+    auto node = path.back();
+    path.pop_back();
+    pushLeftSpine(node->right.get());
+    if (path.empty()) {
+        root.reset();
+    }
+    return *this;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+auto PersistentRBTree<T, EqualTo, Less,
+                      Allocator>::const_iterator::operator++(int)
+    -> const_iterator {
+    auto old = *this;
+    ++*this;
+    return old;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+bool PersistentRBTree<T, EqualTo, Less, Allocator>::const_iterator::operator==(
+    const_iterator const &other) const {
+    if (path.empty() || other.path.empty()) {
+        return path.empty() == other.path.empty();
+    }
+    return path.back() == other.path.back();
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+void PersistentRBTree<T, EqualTo, Less,
+                      Allocator>::const_iterator::pushLeftSpine(Node const
+                                                                    *node) {
+    // Only nodes still to be visited are kept, their right subtrees come
+    // next
+    for (; node; node = node->left.get()) {
+        path.push_back(node);
+    }
+}
+
+}; // namespace rb_tree
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef RB_TREE_PREFIXED_KEY_HPP
+#define RB_TREE_PREFIXED_KEY_HPP
+
+#include <algorithm>
+#include <compare>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string_view>
+#include <utility>
+
+namespace rb_tree {
+
+// First eight bytes of a key as a big-endian number, zero-padded. Ordering
+// two prefixes as integers orders the keys' first eight bytes.
+inline uint64_t keyPrefix(std::string_view key) {
+    unsigned char bytes[8] = {};
+    // An empty view may hold a null pointer, which memcpy must not get
+    if (!key.empty()) {
+        std::memcpy(bytes, key.data(), std::min<std::size_t>(key.size(), 8));
+    }
+    uint64_t prefix = 0;
+    for (auto byte : bytes) {
+        prefix = prefix << 8 | byte;
+    }
+    return prefix;
+}
+
+// Byte-wise order of two keys, starting from their prefixes
+inline std::strong_ordering comparePrefixed(uint64_t aPrefix,
+                                            std::string_view a,
+                                            uint64_t bPrefix,
+                                            std::string_view b) {
+    if (aPrefix != bPrefix) {
+        return aPrefix <=> bPrefix;
+    }
+    // Equal prefixes mean equal bytes up to the shorter of the key and 8;
+    // a key no longer than that is a prefix of the other
+    if (a.size() <= 8 || b.size() <= 8) {
+        return a.size() <=> b.size();
+    }
+    return a.substr(8) <=> b.substr(8);
+}
+
+// A key to search with; the prefix is computed once per search instead of
+// once per comparison
+class PrefixedKeyView {
+  public:
+    explicit PrefixedKeyView(std::string_view text)
+        : _prefix(keyPrefix(text)), text(text) {}
+
+    uint64_t prefix() const { return _prefix; }
+    std::string_view view() const { return text; }
+
+  private:
+    uint64_t _prefix;
+    std::string_view text;
+};
+
+// String key for tree values. Keys of up to inlineCapacity bytes live in the
+// object itself, so a value stored in a node holds its whole key, and every
+// key carries its prefix: most comparisons during a search are a single
+// integer compare and the key bytes are read only on prefix ties.
+class PrefixedKey {
+  public:
+    static constexpr std::size_t inlineCapacity = 16;
+
+    PrefixedKey() : PrefixedKey(std::string_view()) {}
+    explicit PrefixedKey(std::string_view text);
+    PrefixedKey(PrefixedKey const &other);
+    PrefixedKey(PrefixedKey &&other) noexcept;
+    ~PrefixedKey();
+
+    PrefixedKey &operator=(PrefixedKey const &other);
+    PrefixedKey &operator=(PrefixedKey &&other) noexcept;
+
+    uint64_t prefix() const;
+    std::string_view view() const;
+    char const *data() const;
+    std::size_t size() const;
+    bool empty() const;
+
+  private:
+    bool isInline() const;
+    void release();
+    void take(PrefixedKey &other);
+
+    uint64_t _prefix;
+    std::size_t length;
+    union {
+        char buffer[inlineCapacity];
+        char *heap;
+    };
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// PrefixedKey class methods implementation
+
+inline PrefixedKey::PrefixedKey(std::string_view text)
+    : _prefix(keyPrefix(text)), length(text.size()) {
+    if (isInline()) {
+        if (length > 0) {
+            std::memcpy(buffer, text.data(), length);
+        }
+    } else {
+        heap = new char[length];
+        std::memcpy(heap, text.data(), length);
+    }
+}
+
+inline PrefixedKey::PrefixedKey(PrefixedKey const &other)
+    : PrefixedKey(other.view()) {}
+
+inline PrefixedKey::PrefixedKey(PrefixedKey &&other) noexcept {
+    take(other);
+}
+
+inline PrefixedKey::~PrefixedKey() { release(); }
+
+inline auto PrefixedKey::operator=(PrefixedKey const &other)
+    -> PrefixedKey & {
+    if (this != &other) {
+        *this = PrefixedKey(other);
+    }
+    return *this;
+}
+
+inline auto PrefixedKey::operator=(PrefixedKey &&other) noexcept
+    -> PrefixedKey & {
+    if (this != &other) {
+        release();
+        take(other);
+    }
+    return *this;
+}
+
+inline uint64_t PrefixedKey::prefix() const { return _prefix; }
+
+inline std::string_view PrefixedKey::view() const {
+    return std::string_view(data(), length);
+}
+
+inline char const *PrefixedKey::data() const {
+    return isInline() ? buffer : heap;
+}
+
+inline std::size_t PrefixedKey::size() const { return length; }
+
+inline bool PrefixedKey::empty() const { return length == 0; }
+
+inline bool PrefixedKey::isInline() const { return length <= inlineCapacity; }
+
+inline void PrefixedKey::release() {
+    if (!isInline()) {
+        delete[] heap;
+    }
+}
+
+inline void PrefixedKey::take(PrefixedKey &other) {
+    // Leaves other empty
+    _prefix = std::exchange(other._prefix, 0);
+    length = std::exchange(other.length, 0);
+    if (isInline()) {
+        std::memcpy(buffer, other.buffer, length);
+    } else {
+        heap = other.heap;
+    }
+}
+
+inline bool operator==(PrefixedKey const &a, PrefixedKey const &b) {
+    return a.prefix() == b.prefix() && a.view() == b.view();
+}
+
+inline std::strong_ordering operator<=>(PrefixedKey const &a,
+                                        PrefixedKey const &b) {
+    return comparePrefixed(a.prefix(), a.view(), b.prefix(), b.view());
+}
+
+inline bool operator==(PrefixedKey const &a, PrefixedKeyView const &b) {
+    return a.prefix() == b.prefix() && a.view() == b.view();
+}
+
+inline std::strong_ordering operator<=>(PrefixedKey const &a,
+                                        PrefixedKeyView const &b) {
+    return comparePrefixed(a.prefix(), a.view(), b.prefix(), b.view());
+}
+
+inline std::ostream &operator<<(std::ostream &os, PrefixedKey const &key) {
+    return os << key.view();
+}
+
+}; // namespace rb_tree
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef RB_TREE_SET_OPS_HPP
+#define RB_TREE_SET_OPS_HPP
+
+#include "rb_tree.hpp"
+#include "rb_tree_task_pool.hpp"
+#include <algorithm>
+#include <utility>
+
+namespace rb_tree {
+
+////////////////////////////////////////////////////////////////////////////////
+
+// RBTree set operations implementation, kept apart from rb_tree.hpp so that
+// only trees combined in parallel pull in the thread pool
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Pool>
+auto RBTree<T, EqualTo, Less, Allocator>::set_union(RBTree &&a, RBTree &&b,
+                                                    Pool &pool)
+    -> RBTree {
+    return combineTrees(UNION, std::move(a), std::move(b), pool);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Pool>
+auto RBTree<T, EqualTo, Less, Allocator>::set_intersection(RBTree &&a,
+                                                           RBTree &&b,
+                                                           Pool &pool)
+    -> RBTree {
+    return combineTrees(INTERSECTION, std::move(a), std::move(b), pool);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Pool>
+auto RBTree<T, EqualTo, Less, Allocator>::set_difference(RBTree &&a,
+                                                         RBTree &&b,
+                                                         Pool &pool)
+    -> RBTree {
+    return combineTrees(DIFFERENCE, std::move(a), std::move(b), pool);
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Pool>
+auto RBTree<T, EqualTo, Less, Allocator>::combineTrees(SetOperation operation,
+                                                       RBTree &&a, RBTree &&b,
+                                                       Pool &pool)
+    -> RBTree {
+    RBTree result(a.alloc);
+    if (&a == &b) {
+        // The same tree on both sides: a union or an intersection is the
+        // tree itself and a difference is empty
+        if (operation == DIFFERENCE) {
+            a.clear();
+        } else {
+            result = std::move(a);
+        }
+        return result;
+    }
+    RBTree other(a.alloc);
+    other = std::move(b);
+    result.adoptBlocks(a);
+    result.adoptBlocks(other);
+    auto sizeA = a._size;
+    auto sizeB = other._size;
+    auto first = a.detach();
+    auto second = other.detach();
+
+    Leftovers leftovers;
+    Piece piece;
+    auto job = [&] {
+        piece = combine(operation, first, second, pool, leftovers);
+    };
+    if (std::min(first.height, second.height) >= parallelHeight) {
+        pool.run(job);
+    } else {
+        job();
+    }
+
+    result.root = piece.root;
+    if (operation == UNION) {
+        result._size = sizeA + sizeB - leftovers.matches;
+    } else if (operation == INTERSECTION) {
+        result._size = leftovers.matches;
+    } else {
+        result._size = sizeA - leftovers.matches;
+    }
+    for (auto node : leftovers.dropped) {
+        result.destroySubtree(node);
+    }
+    result.rebuildIndex();
+    return result;
+}
+
+template <class T, typename EqualTo, typename Less, typename Allocator>
+template <typename Pool>
+auto RBTree<T, EqualTo, Less, Allocator>::combine(SetOperation operation,
+                                                  Piece a, Piece b,
+                                                  Pool &pool,
+                                                  Leftovers &leftovers)
+    -> Piece {
+    if (!a.root || !b.root) {
+        // A union keeps whichever side is left, a difference keeps a and
+        // an intersection keeps nothing
+        if (operation == UNION) {
+            return a.root ? a : b;
+        }
+        if (b.root) {
+            leftovers.dropped.push_back(b.root);
+        }
+        if (operation == INTERSECTION && a.root) {
+            leftovers.dropped.push_back(a.root);
+            return Piece{};
+        }
+        return a;
+    }
+
+    // Cuts b at the root of a and combines the halves on either side
+    auto middle = a.root;
+    auto less = pieceOf(middle->left, a.height - 1);
+    auto greater = pieceOf(middle->right, a.height - 1);
+    auto cut = cutPiece(b, middle->value);
+    Piece left;
+    Piece right;
+    if (std::min(a.height, b.height) >= parallelHeight) {
+        Leftovers rightLeftovers;
+        pool.fork(
+            [&] {
+                left = combine(operation, less, cut.less, pool, leftovers);
+            },
+            [&] {
+                right = combine(operation, greater, cut.greater, pool,
+                                rightLeftovers);
+            });
+        leftovers.dropped.insert(leftovers.dropped.end(),
+                                 rightLeftovers.dropped.begin(),
+                                 rightLeftovers.dropped.end());
+        leftovers.matches += rightLeftovers.matches;
+    } else {
+        left = combine(operation, less, cut.less, pool, leftovers);
+        right = combine(operation, greater, cut.greater, pool, leftovers);
+    }
+
+    auto drop = [&leftovers](node_ptr node) {
+        node->left = nullptr;
+        node->right = nullptr;
+        leftovers.dropped.push_back(node);
+    };
+    // The key of middle is in b too exactly when cutting found a match
+    bool keep = operation == UNION ||
+                (operation == INTERSECTION) == (cut.match != nullptr);
+    if (cut.match) {
+        ++leftovers.matches;
+        drop(cut.match);
+    }
+    if (keep) {
+        return joinPieces(left, middle, right);
+    }
+    drop(middle);
+    return joinPieces(left, right);
+}
+
+}; // namespace rb_tree
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef RB_TREE_SNAPSHOT_HPP
+#define RB_TREE_SNAPSHOT_HPP
+
+#include "rb_tree_exceptions.hpp"
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace rb_tree {
+
+// Flat snapshot layout, native byte order:
+//   FlatSnapshotHeader
+//   count entries of the tree's FlatEntry, in pre-order
+//   blobSize bytes of variable-length data the records point into
+// The checksum covers everything after the header.
+template <typename T>
+concept FlatSerializable =
+    std::is_trivially_copyable_v<typename T::FlatRecord> &&
+    requires(T const &t, std::string &blob,
+             typename T::FlatRecord const &record, std::string_view view) {
+        { t.toFlat(blob) } -> std::same_as<typename T::FlatRecord>;
+        { T::fromFlat(record, view) } -> std::same_as<T>;
+    };
+
+struct FlatSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint64_t count;
+    uint64_t blobSize;
+    uint64_t checksum;
+};
+
+// One pre-order entry of a flat snapshot; the shape of the tree is given by
+// which children follow
+template <typename Record>
+struct FlatSnapshotEntry {
+    enum Children : uint8_t { HAS_LEFT = 1, HAS_RIGHT = 2 };
+
+    Record record;
+    uint8_t color;
+    uint8_t children;
+};
+
+inline constexpr char flatSnapshotMagic[8] = {'R', 'B', 'T', 'F',
+                                              'L', 'A', 'T', '\0'};
+inline constexpr uint32_t flatSnapshotVersion = 1;
+
+inline bool isFlatSnapshot(std::span<char const> image) {
+    return image.size() >= sizeof(flatSnapshotMagic) &&
+           std::memcmp(image.data(), flatSnapshotMagic,
+                       sizeof(flatSnapshotMagic)) == 0;
+}
+
+// Word-at-a-time FNV-1a variant, fast enough to check a snapshot while it
+// is being loaded
+inline uint64_t flatChecksum(std::span<char const> bytes,
+                             uint64_t hash = 0xcbf29ce484222325ull) {
+    constexpr uint64_t prime = 0x100000001b3ull;
+    std::size_t i = 0;
+    for (; i + sizeof(uint64_t) <= bytes.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, bytes.data() + i, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 29;
+    }
+    for (; i < bytes.size(); ++i) {
+        hash = (hash ^ static_cast<unsigned char>(bytes[i])) * prime;
+    }
+    return hash;
+}
+
+// Writes header, records and blob of a flat snapshot with count entries
+inline void writeFlatSnapshot(std::ostream &os, std::span<char const> records,
+                              uint32_t entrySize, uint64_t count,
+                              std::string_view blob) {
+    FlatSnapshotHeader header;
+    // Padding is part of the file, so it has to be deterministic
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, flatSnapshotMagic, sizeof(header.magic));
+    header.version = flatSnapshotVersion;
+    header.entrySize = entrySize;
+    header.count = count;
+    header.blobSize = blob.size();
+    header.checksum = flatChecksum(blob, flatChecksum(records));
+
+    os.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    os.write(records.data(), static_cast<std::streamsize>(records.size()));
+    os.write(blob.data(), static_cast<std::streamsize>(blob.size()));
+}
+
+// Checks a flat snapshot image and splits it into its parts; throws
+// SnapshotCorrupted if anything does not add up
+struct FlatSnapshotView {
+    uint64_t count;
+    std::span<char const> records;
+    std::string_view blob;
+};
+
+inline FlatSnapshotView openFlatSnapshot(std::span<char const> image,
+                                         uint32_t entrySize) {
+    FlatSnapshotHeader header;
+    if (image.size() < sizeof(header) || !isFlatSnapshot(image)) {
+        throw SnapshotCorrupted("Error: not a flat RBTree snapshot");
+    }
+    std::memcpy(&header, image.data(), sizeof(header));
+    if (header.version != flatSnapshotVersion ||
+        header.entrySize != entrySize) {
+        throw SnapshotCorrupted("Error: unsupported snapshot version");
+    }
+    auto body = image.subspan(sizeof(header));
+    if (header.count > body.size() / entrySize ||
+        body.size() - header.count * entrySize != header.blobSize) {
+        throw SnapshotCorrupted("Error: snapshot is truncated");
+    }
+    auto records = body.first(header.count * entrySize);
+    auto blobBytes = body.subspan(records.size());
+    if (flatChecksum(blobBytes, flatChecksum(records)) != header.checksum) {
+        throw SnapshotCorrupted("Error: snapshot checksum mismatch");
+    }
+    return {header.count, records,
+            std::string_view(blobBytes.data(), blobBytes.size())};
+}
+
+}; // namespace rb_tree
+
+#endif
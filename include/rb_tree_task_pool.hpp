@@ -0,0 +1,282 @@
+#ifndef RB_TREE_TASK_POOL_HPP
+#define RB_TREE_TASK_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rb_tree {
+
+// Fork-join thread pool with work stealing, for divide-and-conquer jobs.
+// fork() queues its second half at the back of the calling worker's deque
+// and runs the first half right away; the worker takes the second half
+// back unless an idle worker stole it from the front meanwhile, where the
+// oldest and so largest pieces of work wait. A worker waiting for a stolen
+// half runs other stolen work instead of blocking.
+class TaskPool {
+  public:
+    // With no threads every job runs in the calling thread
+    explicit TaskPool(
+        std::size_t threads = std::thread::hardware_concurrency());
+    TaskPool(TaskPool const &) = delete;
+    TaskPool &operator=(TaskPool const &) = delete;
+    ~TaskPool();
+
+    std::size_t size() const;
+
+    // Runs job on a worker and returns once it is done, rethrowing what it
+    // threw. Called from a worker of this pool, it simply calls job.
+    template <typename Job>
+    void run(Job &&job);
+    // Runs both halves, in parallel when called from inside a job of this
+    // pool, and returns once both are done. Throws what the first half
+    // threw, or else what the second one did.
+    template <typename First, typename Second>
+    void fork(First &&first, Second &&second);
+
+    // Pool of one thread per core, started on first use
+    static TaskPool &shared();
+
+  private:
+    // Lives on the stack of the thread waiting for it; call() is the last
+    // access to the task by whoever runs it
+    struct Task {
+        void (*call)(Task &task);
+    };
+
+    template <typename Job>
+    struct ForkedTask : Task {
+        explicit ForkedTask(Job &job);
+        static void invoke(Task &task);
+
+        Job &job;
+        std::exception_ptr error;
+        std::atomic<bool> done{false};
+    };
+
+    template <typename Job>
+    struct SubmittedTask : Task {
+        explicit SubmittedTask(Job &job);
+        static void invoke(Task &task);
+
+        Job &job;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+        bool done = false;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task *> tasks;
+    };
+
+    bool onWorker() const;
+    void push(Queue &queue, Task *task);
+    bool takeBack(Queue &queue, Task *task);
+    Task *steal(std::size_t thief);
+    void work(std::size_t id);
+
+    // One queue per worker, then one for jobs handed in by run()
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    // Tasks sitting in any queue; idle workers sleep while there are none
+    std::atomic<std::size_t> queued{0};
+    std::mutex sleeping;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    static thread_local TaskPool *currentPool;
+    static thread_local std::size_t currentWorker;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// TaskPool class methods implementation
+
+inline thread_local TaskPool *TaskPool::currentPool = nullptr;
+inline thread_local std::size_t TaskPool::currentWorker = 0;
+
+inline TaskPool::TaskPool(std::size_t threads) {
+    for (std::size_t i = 0; i <= threads; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    workers.reserve(threads);
+    for (std::size_t id = 0; id < threads; ++id) {
+        workers.emplace_back([this, id] { work(id); });
+    }
+}
+
+inline TaskPool::~TaskPool() {
+    {
+        std::lock_guard guard(sleeping);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+inline std::size_t TaskPool::size() const { return workers.size(); }
+
+inline TaskPool &TaskPool::shared() {
+    static TaskPool pool;
+    return pool;
+}
+
+template <typename Job>
+void TaskPool::run(Job &&job) {
+    if (workers.empty() || onWorker()) {
+        job();
+        return;
+    }
+    SubmittedTask<Job> task(job);
+    push(*queues.back(), &task);
+    std::unique_lock guard(task.mutex);
+    task.finished.wait(guard, [&task] { return task.done; });
+    if (task.error) {
+        std::rethrow_exception(task.error);
+    }
+}
+
+template <typename First, typename Second>
+void TaskPool::fork(First &&first, Second &&second) {
+    if (!onWorker()) {
+        first();
+        second();
+        return;
+    }
+    auto &own = *queues[currentWorker];
+    ForkedTask<Second> task(second);
+    push(own, &task);
+    std::exception_ptr error;
+    try {
+        first();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    // Whatever first forked has been joined already, so the task is
+    // either still on top of the deque or taken by a thief
+    if (takeBack(own, &task)) {
+        ForkedTask<Second>::invoke(task);
+    } else {
+        while (!task.done.load(std::memory_order_acquire)) {
+            if (auto other = steal(currentWorker)) {
+                other->call(*other);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (task.error) {
+        std::rethrow_exception(task.error);
+    }
+}
+
+template <typename Job>
+TaskPool::ForkedTask<Job>::ForkedTask(Job &job)
+    : Task{&ForkedTask::invoke}, job(job) {}
+
+template <typename Job>
+void TaskPool::ForkedTask<Job>::invoke(Task &task) {
+    auto &self = static_cast<ForkedTask &>(task);
+    try {
+        self.job();
+    } catch (...) {
+        self.error = std::current_exception();
+    }
+    self.done.store(true, std::memory_order_release);
+}
+
+template <typename Job>
+TaskPool::SubmittedTask<Job>::SubmittedTask(Job &job)
+    : Task{&SubmittedTask::invoke}, job(job) {}
+
+template <typename Job>
+void TaskPool::SubmittedTask<Job>::invoke(Task &task) {
+    auto &self = static_cast<SubmittedTask &>(task);
+    try {
+        self.job();
+    } catch (...) {
+        self.error = std::current_exception();
+    }
+    // Notifying under the lock keeps the waiter, and so the task, alive
+    // until this is done
+    std::lock_guard guard(self.mutex);
+    self.done = true;
+    self.finished.notify_one();
+}
+
+inline bool TaskPool::onWorker() const { return currentPool == this; }
+
+inline void TaskPool::push(Queue &queue, Task *task) {
+    {
+        std::lock_guard guard(queue.mutex);
+        queue.tasks.push_back(task);
+    }
+    queued.fetch_add(1, std::memory_order_release);
+    // Taking the lock orders this against a worker about to sleep, so the
+    // wakeup cannot slip in between its check and its wait
+    { std::lock_guard guard(sleeping); }
+    wake.notify_one();
+}
+
+inline bool TaskPool::takeBack(Queue &queue, Task *task) {
+    std::lock_guard guard(queue.mutex);
+    if (queue.tasks.empty() || queue.tasks.back() != task) {
+        return false;
+    }
+    queue.tasks.pop_back();
+    queued.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+inline auto TaskPool::steal(std::size_t thief) -> Task * {
+    if (queued.load(std::memory_order_acquire) == 0) {
+        return nullptr;
+    }
+    // Starting past the thief spreads the thieves over the queues
+    for (std::size_t i = 1; i <= queues.size(); ++i) {
+        auto &queue = *queues[(thief + i) % queues.size()];
+        std::lock_guard guard(queue.mutex);
+        if (!queue.tasks.empty()) {
+            auto task = queue.tasks.front();
+            queue.tasks.pop_front();
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+inline void TaskPool::work(std::size_t id) {
+    currentPool = this;
+    currentWorker = id;
+    while (true) {
+        if (auto task = steal(id)) {
+            task->call(*task);
+            continue;
+        }
+        std::unique_lock guard(sleeping);
+        wake.wait(guard, [this] {
+            return stopping || queued.load(std::memory_order_acquire) > 0;
+        });
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+}; // namespace rb_tree
+
+#endif
@@ -0,0 +1,271 @@
+#ifndef FAST_IO_HPP
+#define FAST_IO_HPP
+
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace fast_io {
+
+// Reads a file descriptor in large blocks and cuts it into whitespace
+// separated tokens without copying them. A token stays valid until the next
+// call that reads from the descriptor.
+class InputBuffer {
+  public:
+    explicit InputBuffer(int fd, std::function<void()> beforeRead = {},
+                         std::size_t blockSize = 1 << 20);
+
+    // Empty span once the input is exhausted
+    std::span<char> nextToken();
+    // Hands the last count characters of the last token out again as the
+    // beginning of the next one
+    void putBack(std::size_t count);
+    // Consumes one character of any kind, like std::istream::get
+    bool skipChar();
+    // Everything up to the end of the line, like std::getline
+    std::span<char> restOfLine();
+
+  private:
+    static bool isSpace(char c);
+    bool fill();
+
+    int const fd;
+    std::function<void()> const beforeRead;
+    std::size_t const blockSize;
+    std::vector<char> buffer;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    bool eof = false;
+};
+
+// Collects output in a fixed buffer and writes it out in large chunks.
+// beforeWrite runs before any buffered output reaches the descriptor.
+class OutputBuffer {
+  public:
+    explicit OutputBuffer(int fd, std::function<void()> beforeWrite = {},
+                          std::size_t capacity = 1 << 16);
+    OutputBuffer(OutputBuffer const &) = delete;
+    OutputBuffer &operator=(OutputBuffer const &) = delete;
+    ~OutputBuffer();
+
+    OutputBuffer &operator<<(std::string_view text);
+    OutputBuffer &operator<<(uint64_t number);
+    void flush();
+
+  private:
+    int const fd;
+    std::function<void()> const beforeWrite;
+    std::vector<char> buffer;
+    std::size_t used = 0;
+};
+
+// In-place ASCII lowercase, 16 bytes at a time where SSE2 is available
+inline void lowerAscii(std::span<char> text);
+
+// Parses the number at the start of text the way std::istream >> uint64_t
+// does and returns how many characters it took. 0 is where the stream would
+// fail: no digits at all, or a number out of range.
+inline std::size_t parseUnsigned(std::string_view text, uint64_t &value);
+
+////////////////////////////////////////////////////////////////////////////////
+
+// InputBuffer class methods implementation
+
+inline InputBuffer::InputBuffer(int fd, std::function<void()> beforeRead,
+                                std::size_t blockSize)
+    : fd(fd), beforeRead(std::move(beforeRead)), blockSize(blockSize),
+      buffer(blockSize) {}
+
+inline bool InputBuffer::isSpace(char c) {
+    return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+inline bool InputBuffer::fill() {
+    if (eof) {
+        return false;
+    }
+    // Keep the unread tail, it may be the beginning of a token
+    if (begin > 0) {
+        std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+    }
+    if (buffer.size() - end < blockSize / 2) {
+        buffer.resize(buffer.size() + blockSize);
+    }
+    if (beforeRead) {
+        beforeRead();
+    }
+    ssize_t count;
+    do {
+        count = ::read(fd, buffer.data() + end, buffer.size() - end);
+    } while (count < 0 && errno == EINTR);
+    if (count <= 0) {
+        eof = true;
+        return false;
+    }
+    end += static_cast<std::size_t>(count);
+    return true;
+}
+
+inline std::span<char> InputBuffer::nextToken() {
+    while (true) {
+        while (begin < end && isSpace(buffer[begin])) {
+            ++begin;
+        }
+        if (begin < end || !fill()) {
+            break;
+        }
+    }
+    std::size_t length = 0;
+    while (true) {
+        while (begin + length < end && !isSpace(buffer[begin + length])) {
+            ++length;
+        }
+        if (begin + length < end || !fill()) {
+            break;
+        }
+    }
+    std::span<char> token(buffer.data() + begin, length);
+    begin += length;
+    return token;
+}
+
+inline void InputBuffer::putBack(std::size_t count) { begin -= count; }
+
+inline bool InputBuffer::skipChar() {
+    if (begin == end && !fill()) {
+        return false;
+    }
+    ++begin;
+    return true;
+}
+
+inline std::span<char> InputBuffer::restOfLine() {
+    std::size_t length = 0;
+    while (true) {
+        while (begin + length < end && buffer[begin + length] != '\n') {
+            ++length;
+        }
+        if (begin + length < end || !fill()) {
+            break;
+        }
+    }
+    std::span<char> line(buffer.data() + begin, length);
+    begin += length;
+    if (begin < end) {
+        ++begin;
+    }
+    return line;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// OutputBuffer class methods implementation
+
+inline OutputBuffer::OutputBuffer(int fd, std::function<void()> beforeWrite,
+                                  std::size_t capacity)
+    : fd(fd), beforeWrite(std::move(beforeWrite)), buffer(capacity) {}
+
+inline OutputBuffer::~OutputBuffer() { flush(); }
+
+inline OutputBuffer &OutputBuffer::operator<<(std::string_view text) {
+    if (buffer.size() - used < text.size()) {
+        flush();
+        if (buffer.size() < text.size()) {
+            buffer.resize(text.size());
+        }
+    }
+    std::memcpy(buffer.data() + used, text.data(), text.size());
+    used += text.size();
+    return *this;
+}
+
+inline OutputBuffer &OutputBuffer::operator<<(uint64_t number) {
+    char digits[20];
+    auto result = std::to_chars(digits, digits + sizeof(digits), number);
+    return *this << std::string_view(digits, result.ptr);
+}
+
+inline void OutputBuffer::flush() {
+    if (used > 0 && beforeWrite) {
+        beforeWrite();
+    }
+    std::size_t written = 0;
+    while (written < used) {
+        auto count = ::write(fd, buffer.data() + written, used - written);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        written += static_cast<std::size_t>(count);
+    }
+    used = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+inline void lowerAscii(std::span<char> text) {
+    auto data = text.data();
+    auto size = text.size();
+    std::size_t i = 0;
+#ifdef __SSE2__
+    auto const beforeA = _mm_set1_epi8('A' - 1);
+    auto const afterZ = _mm_set1_epi8('Z' + 1);
+    auto const caseBit = _mm_set1_epi8('a' - 'A');
+    for (; i + 16 <= size; i += 16) {
+        auto chunk =
+            _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+        // Bytes above 0x7f are negative here and never match
+        auto upper = _mm_and_si128(_mm_cmpgt_epi8(chunk, beforeA),
+                                   _mm_cmplt_epi8(chunk, afterZ));
+        chunk = _mm_add_epi8(chunk, _mm_and_si128(upper, caseBit));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(data + i), chunk);
+    }
+#endif
+    for (; i < size; ++i) {
+        if ('A' <= data[i] && data[i] <= 'Z') {
+            data[i] = static_cast<char>(data[i] + ('a' - 'A'));
+        }
+    }
+}
+
+inline std::size_t parseUnsigned(std::string_view text, uint64_t &value) {
+    bool negative = false;
+    std::size_t sign = 0;
+    if (!text.empty() && (text.front() == '+' || text.front() == '-')) {
+        negative = text.front() == '-';
+        sign = 1;
+    }
+    auto result = std::from_chars(text.data() + sign,
+                                  text.data() + text.size(), value);
+    if (result.ec == std::errc::result_out_of_range) {
+        value = UINT64_MAX;
+        return 0;
+    }
+    if (result.ec != std::errc()) {
+        value = 0;
+        return 0;
+    }
+    if (negative) {
+        value = 0 - value;
+    }
+    return static_cast<std::size_t>(result.ptr - text.data());
+}
+
+}; // namespace fast_io
+
+#endif
@@ -1,13 +1,25 @@
+#include "fast_io.hpp"
+#include "operation_log.hpp"
+#include "shard_pool.hpp"
+#include <b_tree.hpp>
 #include <rb_tree.hpp>
+#include <rb_tree_mapped_file.hpp>
+#include <rb_tree_prefixed_key.hpp>
 
+#include <algorithm>
+#include <charconv>
+#include <compare>
+#include <cstdio>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <optional>
+#include <string_view>
 
 using namespace rb_tree;
 
 struct KeyValuePair {
-    std::string key;
+    PrefixedKey key;
     uint64_t value;
 
     void serialize(std::ostream &os) const {
@@ -24,107 +36,805 @@ struct KeyValuePair {
         std::vector<char> buffer(len);
         // Явное приведение к std::streamsize
         is.read(buffer.data(), static_cast<std::streamsize>(len));
-        kv.key.assign(buffer.data(), len);
+        kv.key = PrefixedKey(std::string_view(buffer.data(), len));
         is.read(reinterpret_cast<char *>(&kv.value), sizeof(kv.value));
         return kv;
     }
+
+    // Fixed-size part of a flat snapshot entry; the key lives in the blob
+    struct FlatRecord {
+        uint64_t keyOffset;
+        uint64_t keyLength;
+        uint64_t value;
+    };
+
+    FlatRecord toFlat(std::string &blob) const {
+        FlatRecord record{blob.size(), key.size(), value};
+        blob += key.view();
+        return record;
+    }
+
+    static KeyValuePair fromFlat(FlatRecord const &record,
+                                 std::string_view blob) {
+        if (record.keyOffset > blob.size() ||
+            record.keyLength > blob.size() - record.keyOffset) {
+            throw SnapshotCorrupted("Error: snapshot key is out of range");
+        }
+        return {PrefixedKey(blob.substr(record.keyOffset, record.keyLength)),
+                record.value};
+    }
 };
 
 bool operator==(KeyValuePair const &a, KeyValuePair const &b) {
     return a.key == b.key;
 }
 
-bool operator<(KeyValuePair const &a, KeyValuePair const &b) {
-    return a.key < b.key;
+std::strong_ordering operator<=>(KeyValuePair const &a,
+                                 KeyValuePair const &b) {
+    return a.key <=> b.key;
+}
+
+// Lets the tree look words up without wrapping them in a KeyValuePair
+bool operator==(KeyValuePair const &a, PrefixedKeyView const &b) {
+    return a.key == b;
+}
+
+std::strong_ordering operator<=>(KeyValuePair const &a,
+                                 PrefixedKeyView const &b) {
+    return a.key <=> b;
+}
+
+// Only used with -DRBTREE_HASH_INDEX, which answers exact lookups from a
+// hash table kept beside the tree
+namespace rb_tree {
+template <>
+struct IndexHash<KeyValuePair> {
+    std::size_t operator()(KeyValuePair const &kv) const {
+        return std::hash<std::string_view>()(kv.key.view());
+    }
+    std::size_t operator()(PrefixedKeyView const &key) const {
+        return std::hash<std::string_view>()(key.view());
+    }
+};
+}; // namespace rb_tree
+
+// Build with -DDICTIONARY_BTREE to serve from the B-tree instead; both
+// read and write the same snapshot files
+#ifdef DICTIONARY_BTREE
+#ifdef RBTREE_STATS
+#error "RBTREE_STATS counts the work of RBTree only"
+#endif
+#ifdef RBTREE_HASH_INDEX
+#error "RBTREE_HASH_INDEX is an RBTree option"
+#endif
+using Dictionary = pmr::BTree<KeyValuePair, std::equal_to<>, ThreeWayLess<>>;
+#else
+using Dictionary = pmr::RBTree<KeyValuePair, std::equal_to<>, ThreeWayLess<>>;
+#endif
+
+std::ostream &operator<<(std::ostream &os, KeyValuePair const &kv) {
+    return os << kv.key << " " << kv.value;
 }
 
-void lower(std::string &s) {
-    for (auto &c : s) {
-        if ('A' <= c && c <= 'Z') {
-            c += 'a' - 'A';
+std::string_view view(std::span<char> token) {
+    return std::string_view(token.data(), token.size());
+}
+
+#ifdef RBTREE_STATS
+// Answer to the stats command, built with RBTREE_STATS only
+void printStats(TreeStats const &stats, fast_io::OutputBuffer &out) {
+    out << "compares: " << stats.compares << "\n";
+    out << "rotations: " << stats.rotations << "\n";
+    out << "recolors: " << stats.recolors << "\n";
+    out << "allocations: " << stats.allocations << "\n";
+    out << "height: " << stats.height << "\n";
+    for (std::size_t depth = 0; depth < stats.depths.size(); ++depth) {
+        out << "depth " << depth << ": " << stats.depths[depth] << "\n";
+    }
+}
+#endif
+
+// Consecutive lookup commands, answered together through find_batch. Keys
+// are copied out because tokens do not outlive the next read.
+class LookupBatch {
+  public:
+    void push(std::string_view key) {
+        bytes.insert(bytes.end(), key.begin(), key.end());
+        lengths.push_back(key.size());
+    }
+
+    bool full() const { return lengths.size() >= Dictionary::batchWidth * 4; }
+
+    void answer(Dictionary const &tree, fast_io::OutputBuffer &out) {
+        if (lengths.empty()) {
+            return;
+        }
+        keys.clear();
+        std::size_t offset = 0;
+        for (auto length : lengths) {
+            keys.emplace_back(
+                std::string_view(bytes.data() + offset, length));
+            offset += length;
+        }
+        found.resize(keys.size());
+        tree.find_batch(std::span<PrefixedKeyView const>(keys), found);
+        for (auto kv : found) {
+            if (kv) {
+                out << "OK: " << kv->value << "\n";
+            } else {
+                out << "NoSuchWord\n";
+            }
+        }
+        bytes.clear();
+        lengths.clear();
+    }
+
+  private:
+    std::vector<char> bytes;
+    std::vector<std::size_t> lengths;
+    std::vector<PrefixedKeyView> keys;
+    std::vector<KeyValuePair const *> found;
+};
+
+// Reads a snapshot in either format. Problems are reported to out and
+// leave nothing to load.
+std::optional<Dictionary> loadDictionary(std::string const &filename,
+                                         std::pmr::memory_resource *resource,
+                                         fast_io::OutputBuffer &out) {
+    if (!std::filesystem::exists(filename)) {
+        out << "Error: File '" << filename << "' does not exist\n";
+        return std::nullopt;
+    }
+    try {
+        MappedFile file(filename);
+        if (isFlatSnapshot(file.data())) {
+            return Dictionary::readFromFlatBinary(file.data(), resource);
+        }
+        std::ifstream iff(filename, std::ios::binary);
+        if (!iff) {
+            out << "Error: Cannot open file\n";
+            return std::nullopt;
         }
+        return Dictionary::readFromBinary(iff, resource);
+    } catch (CanNotMapFile const &e) {
+        out << e.what() << "\n";
+    } catch (SnapshotCorrupted const &e) {
+        out << e.what() << "\n";
     }
+    return std::nullopt;
 }
 
-std::istream &operator>>(std::istream &iss, KeyValuePair &kv) {
-    iss >> kv.key >> kv.value;
-    lower(kv.key);
-    return iss;
+// Node order loaded trees are rewritten in by --layout, for faster lookups
+enum class LoadLayout { AS_LOADED, BREADTH_FIRST, VAN_EMDE_BOAS };
+
+// B-tree nodes are cache-line blocks already, so it keeps its layout
+void layOut([[maybe_unused]] Dictionary &tree,
+            [[maybe_unused]] LoadLayout layout) {
+#ifndef DICTIONARY_BTREE
+    if (layout == LoadLayout::BREADTH_FIRST) {
+        tree.compact(Dictionary::BREADTH_FIRST);
+    } else if (layout == LoadLayout::VAN_EMDE_BOAS) {
+        tree.compact(Dictionary::VAN_EMDE_BOAS);
+    }
+#endif
 }
 
-std::ostream &operator<<(std::ostream &os, KeyValuePair &kv) {
-    return os << kv.key << " " << kv.value;
+// Written aside and renamed over the target, so a failed save leaves the
+// previous snapshot whole. With a log, the snapshot is made durable before
+// it becomes the log's new base. Problems are reported to out.
+bool saveDictionary(Dictionary const &tree, std::string const &filename,
+                    bool flat, wal::OperationLog *log,
+                    fast_io::OutputBuffer &out) {
+    auto temporary = filename + ".tmp";
+    std::error_code ignored;
+    {
+        std::ofstream off(temporary, std::ios::binary);
+        if (!off) {
+            out << "Error: Cannot open file\n";
+            return false;
+        }
+        if (flat) {
+            tree.saveToFlatBinary(off);
+        } else {
+            tree.saveToBinary(off);
+        }
+        off.close();
+        if (!off) {
+            std::filesystem::remove(temporary, ignored);
+            out << "Error: Cannot write file\n";
+            return false;
+        }
+    }
+    try {
+        if (log) {
+            wal::OperationLog::syncFile(temporary);
+        }
+        if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+            std::filesystem::remove(temporary, ignored);
+            out << "Error: Cannot replace file '" << filename << "'\n";
+            return false;
+        }
+        if (log) {
+            wal::OperationLog::syncDirectory(filename);
+            log->restart(filename);
+        }
+    } catch (wal::LogError const &e) {
+        std::filesystem::remove(temporary, ignored);
+        out << e.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+void replayLog(wal::OperationLog &log, Dictionary &tree) {
+    log.replay([&tree](wal::OperationLog::Record const &record) {
+        switch (record.kind) {
+        case wal::OperationLog::ADD:
+            tree.try_emplace(PrefixedKeyView(record.key),
+                             PrefixedKey(record.key), record.value);
+            break;
+        case wal::OperationLog::REMOVE:
+            tree.try_remove(PrefixedKeyView(record.key));
+            break;
+        case wal::OperationLog::CLEAR:
+            tree.clear();
+            break;
+        }
+    });
+}
+
+// Loading the log's base snapshot also brings back the changes logged
+// since; any other snapshot becomes the new base
+std::optional<Dictionary> openDictionary(std::string const &filename,
+                                         std::pmr::memory_resource *resource,
+                                         fast_io::OutputBuffer &out,
+                                         wal::OperationLog *log) {
+    auto loaded = loadDictionary(filename, resource, out);
+    if (loaded && log) {
+        if (log->continues(filename)) {
+            replayLog(*log, *loaded);
+        } else {
+            log->restart(filename);
+        }
+    }
+    return loaded;
 }
 
-int main() {
-    RBTree<KeyValuePair> tree;
+// State left by a previous run: the base snapshot plus the logged tail
+std::optional<Dictionary> recoverDictionary(wal::OperationLog &log,
+                                            std::pmr::memory_resource *resource,
+                                            fast_io::OutputBuffer &out) {
+    if (!log.base().empty()) {
+        return openDictionary(log.base(), resource, out, &log);
+    }
+    Dictionary tree(resource);
+    replayLog(log, tree);
+    return tree;
+}
+
+// All commands applied in order to one tree on the calling thread
+class SingleTree {
+  public:
+    SingleTree(fast_io::OutputBuffer &out, wal::OperationLog *log,
+               LoadLayout layout)
+        : tree(&pool), out(out), log(log), layout(layout) {}
+
+    void add(KeyValuePair kv) {
+        lookups.answer(tree, out);
+        // The log still needs the key, so only an unlogged pair moves in
+        bool added = log ? tree.try_add(kv) : tree.try_add(std::move(kv));
+        if (!added) {
+            out << "Exist\n";
+            return;
+        }
+        if (log) {
+            log->append(wal::OperationLog::ADD, kv.key.view(), kv.value);
+        }
+        out << "OK\n";
+    }
+
+    void remove(std::string_view key) {
+        lookups.answer(tree, out);
+        if (!tree.try_remove(PrefixedKeyView(key))) {
+            out << "NoSuchWord\n";
+            return;
+        }
+        if (log) {
+            log->append(wal::OperationLog::REMOVE, key);
+        }
+        out << "OK\n";
+    }
+
+    void lookup(std::string_view key) {
+        lookups.push(key);
+        if (lookups.full()) {
+            lookups.answer(tree, out);
+        }
+    }
+
+    void flush() { lookups.answer(tree, out); }
+
+    void save(std::string const &filename, bool flat) {
+        if (saveDictionary(tree, filename, flat, log, out)) {
+            out << "OK\n";
+        }
+    }
+
+    void load(std::string const &filename) {
+        if (auto loaded = openDictionary(filename, &pool, out, log)) {
+            tree = std::move(*loaded);
+            layOut(tree, layout);
+            out << "OK\n";
+        }
+    }
+
+    bool recover() {
+        auto loaded = recoverDictionary(*log, &pool, out);
+        if (loaded) {
+            tree = std::move(*loaded);
+            layOut(tree, layout);
+        }
+        return loaded.has_value();
+    }
+
+    void print() {
+        out.flush();
+        tree.printTree(std::cout);
+        std::cout << "\n";
+        std::cout.flush();
+    }
+
+#ifdef RBTREE_STATS
+    void stats() { printStats(tree.stats(), out); }
+#endif
+
+    void clear() {
+        tree.clear();
+        if (log) {
+            log->append(wal::OperationLog::CLEAR);
+        }
+        out << "OK\n";
+    }
+
+  private:
+    NodePool pool;
+    Dictionary tree;
+    LookupBatch lookups;
+    fast_io::OutputBuffer &out;
+    wal::OperationLog *const log;
+    LoadLayout const layout;
+};
+
+// The key space is split by hash across shard trees, each owned by its own
+// worker. Commands are collected into batches; every worker applies the
+// commands of its shard in input order, which keeps the order per key, and
+// the answers are written out in input order once the batch is done.
+// Save, Load, print and clear finish the current batch first and then see
+// all shards at once.
+class ShardedTrees {
+  public:
+    ShardedTrees(std::size_t count, fast_io::OutputBuffer &out,
+                 wal::OperationLog *log, LoadLayout layout)
+        : out(out), log(log), layout(layout), workers(count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            shards.push_back(std::make_unique<Shard>());
+        }
+    }
+
+    void add(KeyValuePair kv) {
+        enqueue(Command::ADD, kv.key.view(), kv.value);
+    }
+
+    void remove(std::string_view key) { enqueue(Command::REMOVE, key, 0); }
+
+    void lookup(std::string_view key) { enqueue(Command::FIND, key, 0); }
+
+    void flush() {
+        if (commands.empty()) {
+            return;
+        }
+        answers.resize(commands.size());
+        workers.run([this](std::size_t shard) { apply(*shards[shard]); });
+        if (log) {
+            logChanges();
+        }
+        for (auto const &answer : answers) {
+            switch (answer.kind) {
+            case Answer::OK:
+                out << "OK\n";
+                break;
+            case Answer::FOUND:
+                out << "OK: " << answer.value << "\n";
+                break;
+            case Answer::EXIST:
+                out << "Exist\n";
+                break;
+            case Answer::NO_SUCH_WORD:
+                out << "NoSuchWord\n";
+                break;
+            }
+        }
+        for (auto &shard : shards) {
+            shard->commands.clear();
+        }
+        commands.clear();
+        bytes.clear();
+    }
+
+    void save(std::string const &filename, bool flat) {
+        if (saveDictionary(merged(), filename, flat, log, out)) {
+            out << "OK\n";
+        }
+    }
+
+    void load(std::string const &filename) {
+        auto loaded = openDictionary(filename, std::pmr::new_delete_resource(),
+                                     out, log);
+        if (loaded && distribute(*loaded)) {
+            out << "OK\n";
+        }
+    }
+
+    bool recover() {
+        auto loaded =
+            recoverDictionary(*log, std::pmr::new_delete_resource(), out);
+        return loaded && distribute(*loaded);
+    }
+
+    void print() {
+        out.flush();
+        merged().printTree(std::cout);
+        std::cout << "\n";
+        std::cout.flush();
+    }
+
+#ifdef RBTREE_STATS
+    // Counters are shared by all shards; the depth histograms add up
+    void stats() {
+        TreeStats total;
+        for (auto &shard : shards) {
+            auto stats = shard->tree.stats();
+            total.compares = stats.compares;
+            total.rotations = stats.rotations;
+            total.recolors = stats.recolors;
+            total.allocations = stats.allocations;
+            total.height = std::max(total.height, stats.height);
+            total.depths.resize(total.height);
+            for (std::size_t depth = 0; depth < stats.depths.size(); ++depth) {
+                total.depths[depth] += stats.depths[depth];
+            }
+        }
+        printStats(total, out);
+    }
+#endif
+
+    void clear() {
+        for (auto &shard : shards) {
+            shard->tree.clear();
+        }
+        if (log) {
+            log->append(wal::OperationLog::CLEAR);
+        }
+        out << "OK\n";
+    }
+
+  private:
+    static constexpr std::size_t batchSize = 1 << 14;
+
+    struct Command {
+        enum Kind { ADD, REMOVE, FIND };
+
+        Kind kind;
+        std::size_t keyOffset;
+        std::size_t keyLength;
+        uint64_t value;
+    };
+
+    struct Answer {
+        enum Kind { OK, FOUND, EXIST, NO_SUCH_WORD };
+
+        Kind kind;
+        uint64_t value;
+    };
+
+    struct Shard {
+        NodePool pool;
+        Dictionary tree{&pool};
+        std::vector<std::size_t> commands;
+        // Consecutive lookups of this shard, answered through find_batch
+        std::vector<std::size_t> lookups;
+        std::vector<PrefixedKeyView> keys;
+        std::vector<KeyValuePair const *> found;
+    };
+
+    std::size_t shardOf(std::string_view key) const {
+        return std::hash<std::string_view>()(key) % shards.size();
+    }
+
+    void enqueue(Command::Kind kind, std::string_view key, uint64_t value) {
+        shards[shardOf(key)]->commands.push_back(commands.size());
+        commands.push_back({kind, bytes.size(), key.size(), value});
+        bytes.insert(bytes.end(), key.begin(), key.end());
+        if (commands.size() >= batchSize) {
+            flush();
+        }
+    }
+
+    void apply(Shard &shard) {
+        for (auto index : shard.commands) {
+            auto const &command = commands[index];
+            std::string_view key(bytes.data() + command.keyOffset,
+                                 command.keyLength);
+            if (command.kind == Command::FIND) {
+                shard.lookups.push_back(index);
+                shard.keys.emplace_back(key);
+                continue;
+            }
+            // Lookups queued so far must not see this change
+            answerLookups(shard);
+            auto &answer = answers[index];
+            if (command.kind == Command::ADD) {
+                // The key is only copied out of the batch if it is new
+                answer.kind = shard.tree.try_emplace(PrefixedKeyView(key),
+                                                     PrefixedKey(key),
+                                                     command.value)
+                                  ? Answer::OK
+                                  : Answer::EXIST;
+            } else {
+                answer.kind = shard.tree.try_remove(PrefixedKeyView(key))
+                                  ? Answer::OK
+                                  : Answer::NO_SUCH_WORD;
+            }
+        }
+        answerLookups(shard);
+    }
+
+    void answerLookups(Shard &shard) {
+        shard.found.resize(shard.keys.size());
+        shard.tree.find_batch(std::span<PrefixedKeyView const>(shard.keys),
+                              shard.found);
+        for (std::size_t i = 0; i < shard.lookups.size(); ++i) {
+            auto kv = shard.found[i];
+            answers[shard.lookups[i]] =
+                kv ? Answer{Answer::FOUND, kv->value}
+                   : Answer{Answer::NO_SUCH_WORD, 0};
+        }
+        shard.lookups.clear();
+        shard.keys.clear();
+    }
 
-    std::string word;
-    while (std::cin >> word) {
+    // Hands every shard its part of a whole dictionary
+    bool distribute(Dictionary const &loaded) {
+        // In-order, so every shard receives its part already sorted
+        std::vector<std::vector<KeyValuePair>> parts(shards.size());
+        for (auto const &kv : loaded) {
+            parts[shardOf(kv.key.view())].push_back(kv);
+        }
+        try {
+            for (std::size_t i = 0; i < shards.size(); ++i) {
+                shards[i]->tree.assignSorted(parts[i]);
+                layOut(shards[i]->tree, layout);
+            }
+            return true;
+        } catch (InputNotSorted const &e) {
+            for (auto &shard : shards) {
+                shard->tree.clear();
+            }
+            out << e.what() << "\n";
+            return false;
+        }
+    }
+
+    // Successful changes in input order, the order they are replayed in
+    void logChanges() {
+        for (std::size_t i = 0; i < commands.size(); ++i) {
+            auto const &command = commands[i];
+            if (command.kind == Command::FIND ||
+                answers[i].kind != Answer::OK) {
+                continue;
+            }
+            std::string_view key(bytes.data() + command.keyOffset,
+                                 command.keyLength);
+            log->append(command.kind == Command::ADD
+                            ? wal::OperationLog::ADD
+                            : wal::OperationLog::REMOVE,
+                        key, command.value);
+        }
+    }
+
+    // All shards as one tree, for commands that need the whole dictionary
+    Dictionary merged() const {
+        std::vector<KeyValuePair> all;
+        for (auto const &shard : shards) {
+            auto middle = all.size();
+            all.insert(all.end(), shard->tree.begin(), shard->tree.end());
+            std::inplace_merge(all.begin(),
+                               all.begin() + static_cast<std::ptrdiff_t>(middle),
+                               all.end());
+        }
+        return Dictionary::fromSorted(all, std::pmr::new_delete_resource());
+    }
+
+    fast_io::OutputBuffer &out;
+    wal::OperationLog *const log;
+    LoadLayout const layout;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<Command> commands;
+    std::vector<char> bytes;
+    std::vector<Answer> answers;
+    sharding::ShardPool workers;
+};
+
+template <typename Backend>
+void serve(Backend &backend, fast_io::InputBuffer &in) {
+    for (auto token = in.nextToken(); !token.empty(); token = in.nextToken()) {
+        auto word = view(token);
         if (word == "+") {
-            KeyValuePair kv;
-            std::cin >> kv;
-            try {
-                tree.add(kv);
-                std::cout << "OK\n";
-            } catch (...) {
-                std::cout << "Exist\n";
+            auto key = in.nextToken();
+            if (key.empty()) {
+                break;
             }
+            fast_io::lowerAscii(key);
+            KeyValuePair kv{PrefixedKey(view(key)), 0};
+            auto number = in.nextToken();
+            if (number.empty()) {
+                break;
+            }
+            auto taken = fast_io::parseUnsigned(view(number), kv.value);
+            backend.add(std::move(kv));
+            // Like std::cin: reading stops where no number could be read,
+            // and whatever follows the digits is the next word
+            if (taken == 0) {
+                break;
+            }
+            in.putBack(number.size() - taken);
         } else if (word == "-") {
-            std::cin >> word;
-            lower(word);
-            KeyValuePair kv{word, 0};
-            try {
-                tree.remove(kv);
-                std::cout << "OK\n";
-            } catch (...) {
-                std::cout << "NoSuchWord\n";
+            auto key = in.nextToken();
+            if (key.empty()) {
+                break;
             }
+            fast_io::lowerAscii(key);
+            backend.remove(view(key));
         } else if (word == "!") {
-            std::string cmd, filename;
-            std::cin >> cmd;
-            std::cin.get();
-            std::getline(std::cin, filename);
+            backend.flush();
+            std::string cmd(view(in.nextToken()));
+            in.skipChar();
+            std::string filename(view(in.restOfLine()));
             if (cmd == "Save") {
-                std::ofstream off(filename, std::ios::binary);
-                tree.saveToBinary(off);
-                off.close();
-                std::cout << "OK\n";
+                backend.save(filename, false);
+            } else if (cmd == "SaveFlat") {
+                backend.save(filename, true);
             } else if (cmd == "Load") {
-                if (!std::filesystem::exists(filename)) {
-                    std::cout << "Error: File '" << filename
-                              << "' does not exist\n";
-                } else {
-                    std::ifstream iff(filename, std::ios::binary);
-                    if (iff) {
-                        tree = RBTree<KeyValuePair>::readFromBinary(iff);
-                        std::cout << "OK\n";
-                    } else {
-                        std::cout << "Error: Cannot open file\n";
-                    }
-                    iff.close();
-                }
+                backend.load(filename);
             }
-
         } else if (word == "print") {
-            tree.printTree(std::cout);
-            std::cout << "\n";
+            backend.flush();
+            backend.print();
         } else if (word == "clear") {
-            tree.clear();
-            std::cout << "OK\n";
+            backend.flush();
+            backend.clear();
+#ifdef RBTREE_STATS
+        } else if (word == "stats") {
+            backend.flush();
+            backend.stats();
+#endif
         } else if (word == "exit") {
-            tree.clear();
-            exit(0);
+            break;
         } else {
-            try {
-                lower(word);
-                auto kv = tree.find(KeyValuePair{word, 0});
-                std::cout << "OK: " << kv->value << "\n";
-            } catch (...) {
-                std::cout << "NoSuchWord\n";
-            }
+            fast_io::lowerAscii(token);
+            backend.lookup(view(token));
         }
     }
+    backend.flush();
+}
 
+template <typename Backend>
+int serve(Backend &backend, fast_io::OutputBuffer &out,
+          wal::OperationLog *log) {
+    if (log && !backend.recover()) {
+        out.flush();
+        return 1;
+    }
+    // Answers must be visible before the driver waits for more commands
+    fast_io::InputBuffer in(STDIN_FILENO, [&] {
+        backend.flush();
+        out.flush();
+    });
+    serve(backend, in);
+    out.flush();
     return 0;
 }
+
+// A command-line value that is a decimal number and nothing else
+std::optional<uint64_t> parseNumber(std::string_view text) {
+    uint64_t value;
+    auto last = text.data() + text.size();
+    auto result = std::from_chars(text.data(), last, value);
+    if (text.empty() || result.ec != std::errc() || result.ptr != last) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+int usage() {
+    std::cerr << "Usage: main [--shards N] [--log PATH] "
+                 "[--fsync always|never|MILLISECONDS] [--layout bfs|veb]\n";
+    return 1;
+}
+
+// Empty for anything but always, never or a number of milliseconds
+std::optional<wal::SyncPolicy> syncPolicy(std::string_view mode) {
+    if (mode == "always") {
+        return wal::SyncPolicy{wal::SyncPolicy::ALWAYS, {}};
+    } else if (mode == "never") {
+        return wal::SyncPolicy{wal::SyncPolicy::NEVER, {}};
+    }
+    using Interval = std::chrono::milliseconds;
+    auto interval = parseNumber(mode);
+    if (!interval ||
+        *interval > static_cast<uint64_t>(Interval::max().count())) {
+        return std::nullopt;
+    }
+    return wal::SyncPolicy{wal::SyncPolicy::PERIODIC,
+                           Interval(static_cast<Interval::rep>(*interval))};
+}
+
+int main(int argc, char **argv) {
+    std::size_t shards = 0;
+    std::string logPath;
+    wal::SyncPolicy policy;
+    auto layout = LoadLayout::AS_LOADED;
+    // Every option takes a value
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 == argc) {
+            return usage();
+        }
+        std::string_view option(argv[i]);
+        std::string_view value(argv[i + 1]);
+        if (option == "--shards") {
+            auto count = parseNumber(value);
+            if (!count || *count == 0) {
+                return usage();
+            }
+            shards = *count;
+        } else if (option == "--log") {
+            logPath = value;
+        } else if (option == "--fsync") {
+            auto parsed = syncPolicy(value);
+            if (!parsed) {
+                return usage();
+            }
+            policy = *parsed;
+        } else if (option == "--layout" && value == "bfs") {
+            layout = LoadLayout::BREADTH_FIRST;
+        } else if (option == "--layout" && value == "veb") {
+            layout = LoadLayout::VAN_EMDE_BOAS;
+        } else {
+            return usage();
+        }
+    }
+
+    try {
+        std::optional<wal::OperationLog> log;
+        if (!logPath.empty()) {
+            log.emplace(logPath, policy);
+        }
+        auto logged = log ? &*log : nullptr;
+        // An answer never leaves before the change it confirms is logged,
+        // and one commit covers everything answered in between
+        std::function<void()> commit;
+        if (logged) {
+            commit = [logged] { logged->commit(); };
+        }
+        fast_io::OutputBuffer out(STDOUT_FILENO, commit);
+        if (shards > 0) {
+            ShardedTrees backend(shards, out, logged, layout);
+            return serve(backend, out, logged);
+        }
+        SingleTree backend(out, logged, layout);
+        return serve(backend, out, logged);
+    } catch (wal::LogError const &e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+}
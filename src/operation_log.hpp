@@ -0,0 +1,329 @@
+#ifndef OPERATION_LOG_HPP
+#define OPERATION_LOG_HPP
+
+#include <rb_tree_snapshot.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace wal {
+
+class LogError : public std::runtime_error {
+  public:
+    LogError(std::string const &message) : std::runtime_error(message) {}
+};
+
+// When committed records are forced to disk: on every commit, at most once
+// per interval, or whenever the OS gets to it
+struct SyncPolicy {
+    enum Mode { ALWAYS, PERIODIC, NEVER };
+
+    Mode mode = ALWAYS;
+    std::chrono::milliseconds interval{0};
+};
+
+// Append-only log of the changes made since a snapshot. Layout:
+//   magic, u64 path length, canonical path of the base snapshot (empty for
+//   an empty dictionary)
+//   records: u8 kind, u64 value, u64 key length, key, u64 checksum
+// Records are collected in memory and written by commit(), so one write
+// and at most one sync cover a whole group of commands. A torn record at
+// the end, left by a crash in the middle of a write, is cut off on open.
+class OperationLog {
+  public:
+    enum Kind : uint8_t { ADD = 1, REMOVE = 2, CLEAR = 3 };
+
+    struct Record {
+        Kind kind;
+        std::string_view key;
+        uint64_t value;
+    };
+
+    OperationLog(std::string path, SyncPolicy policy);
+    OperationLog(OperationLog const &) = delete;
+    OperationLog &operator=(OperationLog const &) = delete;
+    ~OperationLog();
+
+    // Whether the log holds the changes made on top of this snapshot
+    bool continues(std::string const &snapshot) const;
+    std::string const &base() const;
+
+    void append(Kind kind, std::string_view key = {}, uint64_t value = 0);
+    void commit();
+    // Drops every record and starts over on top of the given snapshot
+    void restart(std::string const &snapshot);
+
+    // Calls callback(Record const &) for every committed record in order
+    template <typename Callback>
+    void replay(Callback &&callback);
+
+    // Makes a file written through another handle durable
+    static void syncFile(std::string const &path);
+    // Makes a rename into the directory holding path durable
+    static void syncDirectory(std::string const &path);
+
+  private:
+    static constexpr char magic[8] = {'R', 'B', 'T', 'W', 'A', 'L', '\0', '\0'};
+
+    static std::string canonical(std::string const &path);
+    static std::string header(std::string const &base);
+    static void writeAll(int fd, std::string_view bytes);
+    static void sync(int fd);
+    std::string readAll() const;
+    // Offset just past the last intact record
+    std::size_t validEnd(std::string_view bytes) const;
+
+    std::string const path;
+    SyncPolicy const policy;
+    int fd = -1;
+    std::string baseSnapshot;
+    std::size_t headerSize = 0;
+    std::string pending;
+    std::chrono::steady_clock::time_point lastSync;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// OperationLog class methods implementation
+
+inline OperationLog::OperationLog(std::string path, SyncPolicy policy)
+    : path(std::move(path)), policy(policy),
+      lastSync(std::chrono::steady_clock::now()) {
+    fd = ::open(this->path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        throw LogError("Error: Cannot open operation log");
+    }
+    auto bytes = readAll();
+    if (bytes.empty()) {
+        bytes = header("");
+        writeAll(fd, bytes);
+        sync(fd);
+    }
+    uint64_t length = 0;
+    if (bytes.size() < sizeof(magic) + sizeof(length) ||
+        std::memcmp(bytes.data(), magic, sizeof(magic)) != 0) {
+        throw LogError("Error: not an operation log");
+    }
+    std::memcpy(&length, bytes.data() + sizeof(magic), sizeof(length));
+    headerSize = sizeof(magic) + sizeof(length) + length;
+    if (length > bytes.size() - sizeof(magic) - sizeof(length)) {
+        throw LogError("Error: operation log header is truncated");
+    }
+    baseSnapshot = bytes.substr(sizeof(magic) + sizeof(length), length);
+    auto end = validEnd(bytes);
+    if (end != bytes.size() &&
+        ::ftruncate(fd, static_cast<off_t>(end)) != 0) {
+        throw LogError("Error: Cannot truncate operation log");
+    }
+    ::lseek(fd, static_cast<off_t>(end), SEEK_SET);
+}
+
+inline OperationLog::~OperationLog() {
+    try {
+        commit();
+        if (policy.mode != SyncPolicy::NEVER) {
+            sync(fd);
+        }
+    } catch (LogError const &) {
+        // Nothing left to report to
+    }
+    ::close(fd);
+}
+
+inline bool OperationLog::continues(std::string const &snapshot) const {
+    return !baseSnapshot.empty() && canonical(snapshot) == baseSnapshot;
+}
+
+inline std::string const &OperationLog::base() const { return baseSnapshot; }
+
+inline void OperationLog::append(Kind kind, std::string_view key,
+                                 uint64_t value) {
+    auto start = pending.size();
+    uint64_t length = key.size();
+    pending.push_back(static_cast<char>(kind));
+    pending.append(reinterpret_cast<char const *>(&value), sizeof(value));
+    pending.append(reinterpret_cast<char const *>(&length), sizeof(length));
+    pending.append(key);
+    auto checksum = rb_tree::flatChecksum(
+        std::span<char const>(pending.data() + start, pending.size() - start));
+    pending.append(reinterpret_cast<char const *>(&checksum),
+                   sizeof(checksum));
+}
+
+inline void OperationLog::commit() {
+    if (pending.empty()) {
+        return;
+    }
+    writeAll(fd, pending);
+    pending.clear();
+    auto now = std::chrono::steady_clock::now();
+    if (policy.mode == SyncPolicy::ALWAYS ||
+        (policy.mode == SyncPolicy::PERIODIC &&
+         now - lastSync >= policy.interval)) {
+        sync(fd);
+        lastSync = now;
+    }
+}
+
+inline void OperationLog::restart(std::string const &snapshot) {
+    // Written aside and renamed over, so a crash leaves either log whole
+    pending.clear();
+    auto base = canonical(snapshot);
+    auto temporary = path + ".tmp";
+    int next = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (next < 0) {
+        throw LogError("Error: Cannot open operation log");
+    }
+    auto bytes = header(base);
+    writeAll(next, bytes);
+    sync(next);
+    if (::rename(temporary.c_str(), path.c_str()) != 0) {
+        ::close(next);
+        throw LogError("Error: Cannot replace operation log");
+    }
+    ::close(fd);
+    fd = next;
+    baseSnapshot = std::move(base);
+    headerSize = bytes.size();
+    syncDirectory(path);
+}
+
+template <typename Callback>
+void OperationLog::replay(Callback &&callback) {
+    commit();
+    auto bytes = readAll();
+    auto end = validEnd(bytes);
+    std::size_t offset = headerSize;
+    while (offset < end) {
+        Record record;
+        uint64_t length;
+        record.kind = static_cast<Kind>(bytes[offset]);
+        std::memcpy(&record.value, bytes.data() + offset + 1,
+                    sizeof(record.value));
+        std::memcpy(&length, bytes.data() + offset + 1 + sizeof(uint64_t),
+                    sizeof(length));
+        offset += 1 + 2 * sizeof(uint64_t);
+        record.key = std::string_view(bytes.data() + offset, length);
+        offset += length + sizeof(uint64_t);
+        callback(static_cast<Record const &>(record));
+    }
+}
+
+inline void OperationLog::syncFile(std::string const &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw LogError("Error: Cannot open file");
+    }
+    auto synced = ::fdatasync(fd) == 0;
+    ::close(fd);
+    if (!synced) {
+        throw LogError("Error: Cannot sync file");
+    }
+}
+
+inline void OperationLog::syncDirectory(std::string const &path) {
+    auto directory = std::filesystem::path(path).parent_path();
+    if (directory.empty()) {
+        directory = ".";
+    }
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        throw LogError("Error: Cannot open directory");
+    }
+    auto synced = ::fsync(fd) == 0;
+    ::close(fd);
+    if (!synced) {
+        throw LogError("Error: Cannot sync directory");
+    }
+}
+
+inline std::string OperationLog::canonical(std::string const &path) {
+    return std::filesystem::weakly_canonical(path).string();
+}
+
+inline std::string OperationLog::header(std::string const &base) {
+    uint64_t length = base.size();
+    std::string bytes(magic, sizeof(magic));
+    bytes.append(reinterpret_cast<char const *>(&length), sizeof(length));
+    bytes.append(base);
+    return bytes;
+}
+
+inline void OperationLog::writeAll(int fd, std::string_view bytes) {
+    while (!bytes.empty()) {
+        auto count = ::write(fd, bytes.data(), bytes.size());
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw LogError("Error: Cannot write operation log");
+        }
+        bytes.remove_prefix(static_cast<std::size_t>(count));
+    }
+}
+
+inline void OperationLog::sync(int fd) {
+    if (::fdatasync(fd) != 0) {
+        throw LogError("Error: Cannot sync operation log");
+    }
+}
+
+inline std::string OperationLog::readAll() const {
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        throw LogError("Error: Cannot read operation log");
+    }
+    std::string bytes(static_cast<std::size_t>(info.st_size), '\0');
+    std::size_t done = 0;
+    while (done < bytes.size()) {
+        auto count = ::pread(fd, bytes.data() + done, bytes.size() - done,
+                             static_cast<off_t>(done));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            throw LogError("Error: Cannot read operation log");
+        }
+        done += static_cast<std::size_t>(count);
+    }
+    return bytes;
+}
+
+inline std::size_t OperationLog::validEnd(std::string_view bytes) const {
+    constexpr std::size_t fixed = 1 + 2 * sizeof(uint64_t);
+    std::size_t offset = headerSize;
+    while (bytes.size() - offset >= fixed + sizeof(uint64_t)) {
+        uint64_t length;
+        std::memcpy(&length, bytes.data() + offset + 1 + sizeof(uint64_t),
+                    sizeof(length));
+        auto left = bytes.size() - offset - fixed - sizeof(uint64_t);
+        auto kind = static_cast<uint8_t>(bytes[offset]);
+        if (length > left || kind < ADD || kind > CLEAR) {
+            break;
+        }
+        uint64_t checksum;
+        std::memcpy(&checksum, bytes.data() + offset + fixed + length,
+                    sizeof(checksum));
+        if (rb_tree::flatChecksum(std::span<char const>(
+                bytes.data() + offset, fixed + length)) != checksum) {
+            break;
+        }
+        offset += fixed + length + sizeof(checksum);
+    }
+    return offset;
+}
+
+}; // namespace wal
+
+#endif
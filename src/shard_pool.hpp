@@ -0,0 +1,97 @@
+#ifndef SHARD_POOL_HPP
+#define SHARD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sharding {
+
+// One worker thread per shard. run() hands the same job to every worker,
+// each calls it with its own shard index, and run() returns once all of
+// them are done. Between runs the workers sleep, so the caller may touch
+// any shard's data without further locking.
+class ShardPool {
+  public:
+    explicit ShardPool(std::size_t shards);
+    ShardPool(ShardPool const &) = delete;
+    ShardPool &operator=(ShardPool const &) = delete;
+    ~ShardPool();
+
+    std::size_t size() const;
+    void run(std::function<void(std::size_t)> const &job);
+
+  private:
+    void work(std::size_t shard);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable started;
+    std::condition_variable finished;
+    std::function<void(std::size_t)> const *job = nullptr;
+    uint64_t generation = 0;
+    std::size_t running = 0;
+    bool stopping = false;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// ShardPool class methods implementation
+
+inline ShardPool::ShardPool(std::size_t shards) {
+    workers.reserve(shards);
+    for (std::size_t shard = 0; shard < shards; ++shard) {
+        workers.emplace_back([this, shard] { work(shard); });
+    }
+}
+
+inline ShardPool::~ShardPool() {
+    {
+        std::lock_guard guard(mutex);
+        stopping = true;
+    }
+    started.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+inline std::size_t ShardPool::size() const { return workers.size(); }
+
+inline void ShardPool::run(std::function<void(std::size_t)> const &job) {
+    std::unique_lock guard(mutex);
+    this->job = &job;
+    running = workers.size();
+    ++generation;
+    started.notify_all();
+    finished.wait(guard, [this] { return running == 0; });
+    this->job = nullptr;
+}
+
+inline void ShardPool::work(std::size_t shard) {
+    uint64_t seen = 0;
+    std::unique_lock guard(mutex);
+    while (true) {
+        started.wait(guard,
+                     [this, seen] { return stopping || generation != seen; });
+        if (stopping) {
+            return;
+        }
+        seen = generation;
+        auto const &current = *job;
+        guard.unlock();
+        current(shard);
+        guard.lock();
+        if (--running == 0) {
+            finished.notify_one();
+        }
+    }
+}
+
+}; // namespace sharding
+
+#endif
@@ -0,0 +1,74 @@
+#include <b_tree.hpp>
+#include <rb_tree.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// try_emplace on trees with the default comparators: the key is a T, and
+// the value is built from the remaining arguments only when the key is
+// not in the tree yet.
+
+using namespace rb_tree;
+
+struct Entry {
+    struct Build {};
+
+    explicit Entry(uint64_t key) : key(key) {}
+    Entry(uint64_t key, std::string payload, Build)
+        : key(key), payload(std::move(payload)) {
+        ++built;
+    }
+
+    bool operator==(Entry const &other) const { return key == other.key; }
+    bool operator<(Entry const &other) const { return key < other.key; }
+
+    uint64_t key;
+    std::string payload;
+
+    static inline int built = 0;
+};
+
+int failures = 0;
+
+void check(bool condition, char const *what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << "\n";
+        ++failures;
+    }
+}
+
+template <typename Tree>
+void testTryEmplace(char const *name) {
+    std::cerr << name << "\n";
+    Tree tree;
+    Entry::built = 0;
+    check(tree.try_emplace(Entry(1), uint64_t{1}, "one", Entry::Build{}),
+          "adds an absent key");
+    check(Entry::built == 1, "builds the value of an absent key");
+    check(!tree.try_emplace(Entry(1), uint64_t{1}, "uno", Entry::Build{}),
+          "reports a present key");
+    check(Entry::built == 1, "does not build the value of a present key");
+    check(tree.try_find(Entry(1)) != nullptr &&
+              tree.try_find(Entry(1))->payload == "one",
+          "keeps the value already stored");
+    for (uint64_t key = 2; key <= 1000; ++key) {
+        tree.try_emplace(Entry(key), key, "more", Entry::Build{});
+    }
+    auto before = Entry::built;
+    for (uint64_t key = 1; key <= 1000; ++key) {
+        tree.try_emplace(Entry(key), key, "again", Entry::Build{});
+    }
+    check(Entry::built == before, "builds nothing for present keys");
+    check(tree.size() == 1000, "holds every key once");
+}
+
+int main() {
+    testTryEmplace<RBTree<Entry>>("RBTree");
+    testTryEmplace<BTree<Entry>>("BTree");
+    if (failures != 0) {
+        return 1;
+    }
+    std::cerr << "ok\n";
+    return 0;
+}